@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "util.h"
+
+#define HIST_HALF	(HIST_SUB_COUNT / 2)
+
+static unsigned hist_index(uint64_t value)
+{
+	unsigned shift;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+
+	return shift * HIST_HALF + (value >> shift);
+}
+
+static uint64_t hist_lower_bound(unsigned idx)
+{
+	unsigned shift;
+
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+
+	shift = idx / HIST_HALF - 1;
+
+	return (uint64_t)(idx % HIST_HALF + HIST_HALF) << shift;
+}
+
+void hist_init(struct histogram *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *hist, uint64_t value)
+{
+	hist->buckets[hist_index(value)]++;
+	hist->count++;
+	hist->sum += value;
+
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->min = MIN(dst->min, src->min);
+	dst->max = MAX(dst->max, src->max);
+}
+
+/* Returns the lower bound of the bucket holding the pct:th percentile */
+uint64_t hist_percentile(const struct histogram *hist, double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	if (pct >= 100.0)
+		return hist->max;
+
+	target = (uint64_t)(hist->count * pct / 100.0) + 1;
+	if (target > hist->count)
+		target = hist->count;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			return MAX(hist_lower_bound(i), hist->min);
+	}
+
+	return hist->max;
+}
+
+void hist_print(const struct histogram *hist, const char *unit)
+{
+	uint64_t octaves[65] = {};
+	uint64_t peak = 0;
+	unsigned octave;
+	char bar[41];
+	int first = -1;
+	int last = 0;
+	int len;
+	int i;
+
+	if (!hist->count) {
+		printf("no samples\n");
+		return;
+	}
+
+	printf("count %llu min %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu mean %llu (%s)\n",
+	       (unsigned long long)hist->count,
+	       (unsigned long long)hist->min,
+	       (unsigned long long)hist_percentile(hist, 50),
+	       (unsigned long long)hist_percentile(hist, 90),
+	       (unsigned long long)hist_percentile(hist, 99),
+	       (unsigned long long)hist_percentile(hist, 99.9),
+	       (unsigned long long)hist->max,
+	       (unsigned long long)(hist->sum / hist->count),
+	       unit);
+
+	/* Fold the sub-buckets into one row per power of two */
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+
+		octave = i ? 64 - __builtin_clzll(hist_lower_bound(i)) : 0;
+		octaves[octave] += hist->buckets[i];
+		peak = MAX(peak, octaves[octave]);
+
+		if (first < 0)
+			first = octave;
+		last = octave;
+	}
+
+	for (i = first; i <= last; i++) {
+		len = octaves[i] * (sizeof(bar) - 1) / peak;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+
+		printf("  [%12llu, %12llu) %10llu %s\n",
+		       i ? 1ull << (i - 1) : 0ull, i < 64 ? 1ull << i : UINT64_MAX,
+		       (unsigned long long)octaves[i], bar);
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram; each power of two is
+ * split in HIST_SUB_COUNT / 2 linear sub-buckets, giving a relative error of
+ * at most 1 / (HIST_SUB_COUNT / 2) over the full 64-bit range.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT / 2 + HIST_SUB_COUNT / 2)
+
+struct histogram {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *hist);
+void hist_record(struct histogram *hist, uint64_t value);
+void hist_merge(struct histogram *dst, const struct histogram *src);
+uint64_t hist_percentile(const struct histogram *hist, double pct);
+void hist_print(const struct histogram *hist, const char *unit);
+
+#endif
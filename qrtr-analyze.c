@@ -0,0 +1,552 @@
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-capture.h"
+#include "qrtr-metrics.h"
+#include "histogram.h"
+#include "util.h"
+
+/*
+ * Per flow statistics from a capture file.
+ *
+ * The capture is mapped and its packets are collected into batches of
+ * pointers. The headers of each batch are loaded as vectors and transposed
+ * with shuffles, LANES at a time, into one vector per header field, which is
+ * matched against the filter with GCC vector extensions, so the filter costs
+ * a handful of vector compares per LANES packets regardless of how many
+ * conditions are given. Only the matching
+ * packets are looked at individually.
+ *
+ * A flow is one direction between two node:port pairs. For each DATA flow the
+ * packet and byte counts, the number of packets from one confirm_rx to the
+ * next, and the time from a confirm_rx packet until the RESUME_TX travelling
+ * the opposite way are reported. Filtering on a packet type other than DATA
+ * or RESUME_TX therefore leaves the flow table empty, while filtering on
+ * either of them drops the turnaround.
+ *
+ * Only v1 headers are analyzed. Packets with v2 headers, as sent by emulated
+ * nodes running with -V 2, and packets too short for their header are
+ * counted separately in the summary.
+ */
+
+#define LANES		8
+#define BATCH		(32 * LANES)
+
+#define FLOW_HASH_MIN	1024
+
+typedef uint32_t v32u __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+/* Word offsets in struct qrtr_hdr_v1 */
+enum {
+	F_VERSION,
+	F_TYPE,
+	F_SRC_NODE,
+	F_SRC_PORT,
+	F_CONFIRM_RX,
+	F_SIZE,
+	F_DST_NODE,
+	F_DST_PORT,
+	F_COUNT,
+};
+
+struct flow {
+	uint32_t src_node;
+	uint32_t src_port;
+	uint32_t dst_node;
+	uint32_t dst_port;
+
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t confirms;
+
+	uint64_t last_confirm;
+	uint64_t pending_ts;
+
+	struct histogram *spacing;
+	struct histogram *turnaround;
+};
+
+struct filter {
+	bool type;
+	bool node;
+	bool port;
+	bool confirm_rx;
+
+	uint32_t type_id;
+	uint32_t node_id;
+	uint32_t port_id;
+};
+
+static const char * const type_names[] = {
+	[QRTR_TYPE_DATA] = "data",
+	[QRTR_TYPE_HELLO] = "hello",
+	[QRTR_TYPE_BYE] = "bye",
+	[QRTR_TYPE_NEW_SERVER] = "new-server",
+	[QRTR_TYPE_DEL_SERVER] = "del-server",
+	[QRTR_TYPE_DEL_CLIENT] = "del-client",
+	[QRTR_TYPE_RESUME_TX] = "resume-tx",
+	[QRTR_TYPE_EXIT] = "exit",
+	[QRTR_TYPE_PING] = "ping",
+	[QRTR_TYPE_NEW_LOOKUP] = "new-lookup",
+	[QRTR_TYPE_DEL_LOOKUP] = "del-lookup",
+};
+
+static struct {
+	unsigned int count;
+	uint64_t ts[BATCH];
+	const void *pkt[BATCH];
+	size_t len[BATCH];
+} batch;
+
+static struct filter filter;
+
+static struct flow **flows;
+static size_t flow_hash_size;
+static size_t flow_count;
+
+static uint64_t total_packets;
+static uint64_t total_bytes;
+static uint64_t matched_packets;
+static uint64_t v2_packets;
+static uint64_t invalid_packets;
+static uint64_t type_counts[ARRAY_SIZE(type_names) + 1];
+
+static size_t flow_hash(uint32_t src_node, uint32_t src_port, uint32_t dst_node, uint32_t dst_port)
+{
+	uint64_t h;
+
+	h = (uint64_t)src_node << 32 | src_port;
+	h ^= ((uint64_t)dst_node << 32 | dst_port) * 0x9e3779b97f4a7c15ull;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 32;
+
+	return h & (flow_hash_size - 1);
+}
+
+static void flow_grow(void)
+{
+	struct flow **old = flows;
+	size_t old_size = flow_hash_size;
+	struct flow *flow;
+	size_t idx;
+	size_t i;
+
+	flow_hash_size = old_size ? 2 * old_size : FLOW_HASH_MIN;
+	flows = calloc(flow_hash_size, sizeof(*flows));
+	if (!flows)
+		err(1, "failed to allocate flow table");
+
+	for (i = 0; i < old_size; i++) {
+		flow = old[i];
+		if (!flow)
+			continue;
+
+		idx = flow_hash(flow->src_node, flow->src_port, flow->dst_node, flow->dst_port);
+		while (flows[idx])
+			idx = (idx + 1) & (flow_hash_size - 1);
+		flows[idx] = flow;
+	}
+
+	free(old);
+}
+
+static struct flow *flow_lookup(uint32_t src_node, uint32_t src_port,
+				uint32_t dst_node, uint32_t dst_port, bool create)
+{
+	struct flow *flow;
+	size_t idx;
+
+	if (!flow_hash_size)
+		flow_grow();
+
+	idx = flow_hash(src_node, src_port, dst_node, dst_port);
+	while ((flow = flows[idx])) {
+		if (flow->src_node == src_node && flow->src_port == src_port &&
+		    flow->dst_node == dst_node && flow->dst_port == dst_port)
+			return flow;
+
+		idx = (idx + 1) & (flow_hash_size - 1);
+	}
+
+	if (!create)
+		return NULL;
+
+	flow = calloc(1, sizeof(*flow));
+	if (!flow)
+		err(1, "failed to allocate flow");
+
+	flow->src_node = src_node;
+	flow->src_port = src_port;
+	flow->dst_node = dst_node;
+	flow->dst_port = dst_port;
+
+	flows[idx] = flow;
+
+	/* Keep the load factor below a half */
+	if (++flow_count * 2 > flow_hash_size)
+		flow_grow();
+
+	return flow;
+}
+
+static struct histogram *flow_hist(struct histogram **hist)
+{
+	if (!*hist) {
+		*hist = malloc(sizeof(**hist));
+		if (!*hist)
+			err(1, "failed to allocate histogram");
+
+		hist_init(*hist);
+	}
+
+	return *hist;
+}
+
+static void account(uint64_t ts, const uint32_t *f)
+{
+	struct flow *flow;
+
+	matched_packets++;
+	type_counts[MIN(f[F_TYPE], ARRAY_SIZE(type_names))]++;
+
+	switch (f[F_TYPE]) {
+	case QRTR_TYPE_DATA:
+		flow = flow_lookup(f[F_SRC_NODE], f[F_SRC_PORT], f[F_DST_NODE], f[F_DST_PORT], true);
+		flow->packets++;
+		flow->bytes += f[F_SIZE];
+
+		if (!f[F_CONFIRM_RX])
+			break;
+
+		if (flow->confirms)
+			hist_record(flow_hist(&flow->spacing), flow->packets - flow->last_confirm);
+
+		flow->confirms++;
+		flow->last_confirm = flow->packets;
+
+		/* Measure from the oldest confirm_rx still waiting for a resume */
+		if (!flow->pending_ts)
+			flow->pending_ts = ts;
+		break;
+	case QRTR_TYPE_RESUME_TX:
+		flow = flow_lookup(f[F_DST_NODE], f[F_DST_PORT], f[F_SRC_NODE], f[F_SRC_PORT], false);
+		if (!flow || !flow->pending_ts)
+			break;
+
+		hist_record(flow_hist(&flow->turnaround), ts - flow->pending_ts);
+		flow->pending_ts = 0;
+		break;
+	}
+}
+
+/* One step of the transpose: swap the off-diagonal blocks of rows x and y */
+static void transpose_step(v32u *x, v32u *y, v32u lo, v32u hi)
+{
+	v32u a = *x;
+	v32u b = *y;
+
+	*x = __builtin_shuffle(a, b, lo);
+	*y = __builtin_shuffle(a, b, hi);
+}
+
+_Static_assert(LANES == F_COUNT, "gather() transposes a square of headers");
+
+/*
+ * Transpose the headers of up to LANES packets into one vector per field;
+ * lanes without a complete header, or beyond count, get version 0 and never
+ * match. Each header is loaded as one vector and the 8x8 transpose is done
+ * in three steps of shuffles, swapping blocks of 1, 2 and 4 words between
+ * rows.
+ */
+static void gather(const void **pkts, const size_t *lens, unsigned int count,
+		   v32u fields[F_COUNT])
+{
+	static const v32u lo1 = { 0, 8, 2, 10, 4, 12, 6, 14 };
+	static const v32u hi1 = { 1, 9, 3, 11, 5, 13, 7, 15 };
+	static const v32u lo2 = { 0, 1, 8, 9, 4, 5, 12, 13 };
+	static const v32u hi2 = { 2, 3, 10, 11, 6, 7, 14, 15 };
+	static const v32u lo4 = { 0, 1, 2, 3, 8, 9, 10, 11 };
+	static const v32u hi4 = { 4, 5, 6, 7, 12, 13, 14, 15 };
+	unsigned int lane;
+	unsigned int i;
+
+	for (lane = 0; lane < LANES; lane++) {
+		if (lane < count && lens[lane] >= sizeof(struct qrtr_hdr_v1))
+			memcpy(&fields[lane], pkts[lane], sizeof(fields[lane]));
+		else
+			fields[lane] = (v32u){};
+	}
+
+	for (i = 0; i < F_COUNT; i += 2)
+		transpose_step(&fields[i], &fields[i + 1], lo1, hi1);
+
+	for (i = 0; i < F_COUNT; i += 4) {
+		transpose_step(&fields[i], &fields[i + 2], lo2, hi2);
+		transpose_step(&fields[i + 1], &fields[i + 3], lo2, hi2);
+	}
+
+	for (i = 0; i < F_COUNT / 2; i++)
+		transpose_step(&fields[i], &fields[i + 4], lo4, hi4);
+}
+
+static void match(const v32u fields[F_COUNT], v32u *mask)
+{
+	v32u m;
+
+	m = fields[F_VERSION] == 1;
+
+	if (filter.type)
+		m &= fields[F_TYPE] == filter.type_id;
+
+	if (filter.node)
+		m &= (fields[F_SRC_NODE] == filter.node_id) | (fields[F_DST_NODE] == filter.node_id);
+
+	if (filter.port)
+		m &= (fields[F_SRC_PORT] == filter.port_id) | (fields[F_DST_PORT] == filter.port_id);
+
+	if (filter.confirm_rx)
+		m &= fields[F_CONFIRM_RX] != 0;
+
+	*mask = m;
+}
+
+static void batch_flush(void)
+{
+	v32u fields[F_COUNT];
+	uint32_t f[F_COUNT];
+	unsigned int count;
+	unsigned int lane;
+	unsigned int base;
+	unsigned int i;
+	v32u zero = {};
+	v32u m;
+
+	for (base = 0; base < batch.count; base += LANES) {
+		count = MIN(batch.count - base, LANES);
+
+		gather(&batch.pkt[base], &batch.len[base], count, fields);
+
+		match(fields, &m);
+		if (!memcmp(&m, &zero, sizeof(m)))
+			continue;
+
+		for (lane = 0; lane < count; lane++) {
+			if (!m[lane])
+				continue;
+
+			for (i = 0; i < F_COUNT; i++)
+				f[i] = fields[i][lane];
+
+			account(batch.ts[base + lane], f);
+		}
+	}
+
+	batch.count = 0;
+}
+
+static void add_packet(uint64_t ts, const void *pkt, size_t len, int dir, void *data)
+{
+	total_packets++;
+	total_bytes += len;
+
+	if (len < sizeof(struct qrtr_hdr_v1) || *(const uint8_t *)pkt != QRTR_PROTO_VER_1) {
+		if (len >= sizeof(struct qrtr_hdr_v2) && *(const uint8_t *)pkt == QRTR_PROTO_VER_2)
+			v2_packets++;
+		else
+			invalid_packets++;
+		return;
+	}
+
+	batch.ts[batch.count] = ts;
+	batch.pkt[batch.count] = pkt;
+	batch.len[batch.count] = len;
+
+	if (++batch.count == BATCH)
+		batch_flush();
+}
+
+static int flow_cmp(const void *a, const void *b)
+{
+	const struct flow *fa = *(const struct flow **)a;
+	const struct flow *fb = *(const struct flow **)b;
+
+	if (fa->packets != fb->packets)
+		return fa->packets < fb->packets ? 1 : -1;
+
+	return 0;
+}
+
+static void print_flows(unsigned int limit)
+{
+	struct flow **sorted;
+	struct flow *flow;
+	char src[32];
+	char dst[32];
+	size_t count = 0;
+	size_t i;
+
+	sorted = malloc((flow_count + 1) * sizeof(*sorted));
+	if (!sorted)
+		err(1, "failed to allocate flows");
+
+	for (i = 0; i < flow_hash_size; i++) {
+		if (flows[i])
+			sorted[count++] = flows[i];
+	}
+
+	qsort(sorted, count, sizeof(*sorted), flow_cmp);
+
+	if (limit && count > limit)
+		count = limit;
+
+	printf("%-16s %-16s %10s %12s %8s %8s %8s %10s %10s %10s\n",
+	       "src", "dst", "packets", "bytes", "confirm",
+	       "spc p50", "spc max", "rsm p50", "rsm p99", "rsm max");
+
+	for (i = 0; i < count; i++) {
+		flow = sorted[i];
+
+		snprintf(src, sizeof(src), "%u:%u", flow->src_node, flow->src_port);
+		snprintf(dst, sizeof(dst), "%u:%u", flow->dst_node, flow->dst_port);
+
+		printf("%-16s %-16s %10llu %12llu %8llu", src, dst,
+		       (unsigned long long)flow->packets,
+		       (unsigned long long)flow->bytes,
+		       (unsigned long long)flow->confirms);
+
+		if (flow->spacing)
+			printf(" %8llu %8llu",
+			       (unsigned long long)hist_percentile(flow->spacing, 50),
+			       (unsigned long long)flow->spacing->max);
+		else
+			printf(" %8s %8s", "-", "-");
+
+		if (flow->turnaround)
+			printf(" %10llu %10llu %10llu",
+			       (unsigned long long)hist_percentile(flow->turnaround, 50),
+			       (unsigned long long)hist_percentile(flow->turnaround, 99),
+			       (unsigned long long)flow->turnaround->max);
+		else
+			printf(" %10s %10s %10s", "-", "-", "-");
+
+		printf("\n");
+
+		if (flow->turnaround)
+			hist_merge(metric_hist("resume_tx_turnaround", "ns"), flow->turnaround);
+	}
+
+	if (count < flow_count)
+		printf("... %zu more flows\n", flow_count - count);
+
+	free(sorted);
+}
+
+static uint32_t parse_type(const char *name)
+{
+	unsigned long type;
+	char *end;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(type_names); i++) {
+		if (type_names[i] && !strcmp(type_names[i], name))
+			return i;
+	}
+
+	type = strtoul(name, &end, 0);
+	if (!*name || *end)
+		errx(1, "unknown packet type %s", name);
+
+	return type;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-analyze [-c] [-n node] [-p port] [-t type] [-N flows] capture\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int limit = 20;
+	uint64_t start;
+	uint64_t elapsed;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "cn:N:p:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			filter.confirm_rx = true;
+			break;
+		case 'n':
+			filter.node = true;
+			filter.node_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			limit = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			filter.port = true;
+			filter.port_id = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			filter.type = true;
+			filter.type_id = parse_type(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind + 1 != argc)
+		usage();
+
+	start = time_ns();
+
+	qrtr_capture_load(argv[optind], add_packet, NULL);
+	batch_flush();
+
+	elapsed = time_ns() - start;
+
+	printf("%llu packets, %llu bytes in %.3f s (%.0f MB/s), %llu matched\n",
+	       (unsigned long long)total_packets, (unsigned long long)total_bytes,
+	       elapsed / 1e9, total_bytes / (elapsed / 1e9) / 1e6,
+	       (unsigned long long)matched_packets);
+
+	if (v2_packets)
+		printf("  %-12s %llu, not analyzed\n", "v2 header", (unsigned long long)v2_packets);
+	if (invalid_packets)
+		printf("  %-12s %llu\n", "invalid", (unsigned long long)invalid_packets);
+
+	for (i = 0; i < ARRAY_SIZE(type_counts); i++) {
+		if (!type_counts[i])
+			continue;
+
+		if (i < ARRAY_SIZE(type_names) && type_names[i])
+			printf("  %-12s %llu\n", type_names[i], (unsigned long long)type_counts[i]);
+		else
+			printf("  %-12s %llu\n", "other", (unsigned long long)type_counts[i]);
+	}
+
+	printf("\n");
+
+	print_flows(limit);
+
+	metric_count("packets", total_packets);
+	metric_count("matched", matched_packets);
+	metric_count("v2_packets", v2_packets);
+	metric_count("invalid_packets", invalid_packets);
+	metric_gauge("packets_per_s", total_packets * 1e9 / elapsed);
+
+	return 0;
+}
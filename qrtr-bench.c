@@ -0,0 +1,674 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-capture.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "qrtr-uring.h"
+#include "util.h"
+
+/*
+ * Sustained throughput benchmark.
+ *
+ * For each payload size in the sweep traffic is pushed for a fixed duration
+ * in one direction:
+ *
+ * tx: from an AF_QIPCRTR socket to an emulated remote on qrtr-tun, which
+ *     acknowledges confirm_rx packets with a RESUME_TX.
+ * rx: from the emulated remote to a bound AF_QIPCRTR socket, honoring the
+ *     recommended flow control watermarks.
+ *
+ * The two halves run in separate processes; the child reports its message
+ * count and CPU time back to the parent over a pipe. With -u the emulated
+ * remote batches its tun I/O through io_uring, and with -V 2 it sends the
+ * compact v2 header instead of v1.
+ *
+ * The default sweep goes up to 65535 bytes, the largest payload the kernel
+ * takes from a socket. Payloads are filled with a pseudo random pattern and
+ * the receiving end checks the size and checksum of every message, unless
+ * disabled with -n to measure the bare copy cost. Besides the per message CPU
+ * time, the total CPU time of both ends per payload byte is reported.
+ */
+
+#define REMOTE_NODE	100
+#define REMOTE_PORT	100
+
+#define FLOW_H		10
+#define FLOW_L		5
+
+/* Largest payload a socket can send, the pool slabs are sized to receive it */
+#define MAX_PAYLOAD	QRTR_MAX_PAYLOAD
+#define MAX_SIZES	32
+
+#define URING_BATCH	32
+
+struct bench_result {
+	uint64_t msgs;
+	uint64_t corrupt;
+	uint64_t cpu_ns;
+};
+
+static const size_t default_sizes[] = { 4, 16, 64, 256, 1024, 4096, 16384, MAX_PAYLOAD };
+
+static unsigned duration = 5;
+static unsigned uring_depth;
+static unsigned hdr_version = QRTR_PROTO_VER_1;
+static bool verify = true;
+
+static char payload[MAX_PAYLOAD];
+static uint64_t payload_csum;
+
+/*
+ * Fletcher style checksum over 32-bit words, cheap enough to keep up with a
+ * memcpy() while still catching truncated, reordered and stale data.
+ */
+static uint64_t csum(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t a = 0;
+	uint64_t b = 0;
+	uint32_t word;
+
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(&word, p, 4);
+		a += word;
+		b += a;
+	}
+
+	for (; len; p++, len--) {
+		a += *p;
+		b += a;
+	}
+
+	return b << 32 ^ a;
+}
+
+static void payload_fill(size_t size)
+{
+	uint32_t x = 0x9e3779b9 ^ size;
+	size_t i;
+
+	/* xorshift32, so that misplaced data doesn't match */
+	for (i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		payload[i] = x;
+	}
+
+	payload_csum = csum(payload, size);
+}
+
+static bool payload_ok(const void *data, size_t len, size_t size)
+{
+	if (!verify)
+		return true;
+
+	return len == size && csum(data, len) == payload_csum;
+}
+
+static struct qrtr_node *open_remote(void)
+{
+	struct qrtr_node *node;
+	int tun_fd;
+	int ret;
+
+	tun_fd = qrtr_tun_open();
+	if (tun_fd < 0)
+		err(1, "failed to open qrtr-tun");
+
+	node = qrtr_node_new(REMOTE_NODE, tun_fd);
+	node->version = hdr_version;
+
+	ret = qrtr_node_hello(node);
+	if (ret < 0)
+		err(1, "failed to hello");
+
+	return node;
+}
+
+static void remote_use_uring(struct qrtr_node *node)
+{
+	int ret;
+
+	if (!uring_depth)
+		return;
+
+	ret = qrtr_node_use_uring(node, uring_depth, QRTR_POOL_SLAB_SIZE);
+	if (ret < 0)
+		err(1, "[remote] failed to set up io_uring");
+}
+
+static void report(const char *dir, size_t size, uint64_t msgs, uint64_t elapsed_ns,
+		   uint64_t local_cpu_ns, uint64_t remote_cpu_ns)
+{
+	double secs = elapsed_ns / 1e9;
+	double per_byte;
+	char name[64];
+
+	per_byte = msgs ? (double)(local_cpu_ns + remote_cpu_ns) / (msgs * size) : 0;
+
+	printf("%-3s %6zu %10llu %12.0f %10.2f %10.0f %10.0f %8.3f\n",
+	       dir, size, (unsigned long long)msgs,
+	       msgs / secs, msgs * size / secs / 1e6,
+	       msgs ? (double)local_cpu_ns / msgs : 0,
+	       msgs ? (double)remote_cpu_ns / msgs : 0,
+	       per_byte);
+	fflush(stdout);
+
+	snprintf(name, sizeof(name), "%s.%zu.msgs_per_s", dir, size);
+	metric_gauge(name, msgs / secs);
+	snprintf(name, sizeof(name), "%s.%zu.cpu_ns", dir, size);
+	metric_gauge(name, msgs ? (double)local_cpu_ns / msgs : 0);
+	snprintf(name, sizeof(name), "%s.%zu.remote_cpu_ns", dir, size);
+	metric_gauge(name, msgs ? (double)remote_cpu_ns / msgs : 0);
+	snprintf(name, sizeof(name), "%s.%zu.cpu_ns_per_byte", dir, size);
+	metric_gauge(name, per_byte);
+	snprintf(name, sizeof(name), "%s.%zu.MB_per_s", dir, size);
+	metric_gauge(name, msgs * size / secs / 1e6);
+}
+
+static void tx_remote(struct qrtr_node *node, size_t size, int ctl_fd, int res_fd)
+{
+	struct bench_result res = {};
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd[2];
+	bool done = false;
+	ssize_t n;
+	int ret;
+
+	pfd[0].fd = node->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctl_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		/* Once the sender is done, drain until the tun goes idle */
+		ret = poll(pfd, 2, done ? 100 : -1);
+		if (ret < 0)
+			err(1, "[remote] poll failed");
+		if (!ret)
+			break;
+
+		if (pfd[1].revents) {
+			done = true;
+			pfd[1].fd = -1;
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
+			err(1, "[remote] failed to read");
+
+		hdr = pkt->hdr;
+		if (hdr->type == QRTR_TYPE_DATA) {
+			res.msgs++;
+
+			if (!payload_ok(pkt->data, pkt->len, size))
+				res.corrupt++;
+
+			if (hdr->confirm_rx)
+				qrtr_resume_tx(node, hdr->dst_node_id, hdr->dst_port_id, hdr->src_node_id, hdr->src_port_id);
+		}
+
+		qrtr_pkt_put(pkt);
+	}
+
+	res.cpu_ns = cpu_time_ns();
+
+	n = write(res_fd, &res, sizeof(res));
+	if (n != sizeof(res))
+		err(1, "[remote] failed to report result");
+}
+
+static void tx_remote_uring(struct qrtr_node *node, size_t size, int ctl_fd, int res_fd)
+{
+	struct qrtr_capture *cap = qrtr_node_capture();
+	struct qrtr_uring_pkt pkts[URING_BATCH];
+	struct bench_result res = {};
+	struct qrtr_hdr_v1 *hdr;
+	struct pollfd pfd;
+	bool done = false;
+	ssize_t n;
+	int ret;
+	int i;
+
+	pfd.fd = ctl_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		ret = qrtr_uring_recv(node->uring, pkts, URING_BATCH, 100);
+		if (ret < 0)
+			err(1, "[remote] failed to read");
+
+		if (!ret) {
+			if (done)
+				break;
+
+			done = poll(&pfd, 1, 0) > 0;
+			continue;
+		}
+
+		for (i = 0; i < ret; i++) {
+			hdr = pkts[i].data;
+
+			if (pkts[i].len < sizeof(*hdr))
+				errx(1, "[remote] short read");
+
+			if (cap)
+				qrtr_capture(cap, QRTR_CAPTURE_RX, pkts[i].data, pkts[i].len);
+
+			if (hdr->type == QRTR_TYPE_DATA) {
+				res.msgs++;
+
+				if (hdr->size > pkts[i].len - sizeof(*hdr) ||
+				    !payload_ok(hdr + 1, hdr->size, size))
+					res.corrupt++;
+
+				if (hdr->confirm_rx)
+					qrtr_resume_tx(node, hdr->dst_node_id, hdr->dst_port_id,
+						       hdr->src_node_id, hdr->src_port_id);
+			}
+
+			qrtr_uring_release(node->uring, &pkts[i]);
+		}
+	}
+
+	res.cpu_ns = cpu_time_ns();
+
+	n = write(res_fd, &res, sizeof(res));
+	if (n != sizeof(res))
+		err(1, "[remote] failed to report result");
+}
+
+static void bench_tx(size_t size)
+{
+	struct sockaddr_qrtr sq = { AF_QIPCRTR, REMOTE_NODE, REMOTE_PORT };
+	struct bench_result res;
+	struct qrtr_node *node;
+	uint64_t cpu_start;
+	uint64_t start;
+	uint64_t end;
+	uint64_t now;
+	uint64_t sent = 0;
+	int ctl[2];
+	int rpt[2];
+	ssize_t n;
+	int sock;
+	int pid;
+
+	if (pipe(ctl) < 0 || pipe(rpt) < 0)
+		err(1, "failed to create pipes");
+
+	node = open_remote();
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		err(1, "fork failed");
+	case 0:
+		close(ctl[1]);
+		close(rpt[0]);
+		remote_use_uring(node);
+		if (node->uring)
+			tx_remote_uring(node, size, ctl[0], rpt[1]);
+		else
+			tx_remote(node, size, ctl[0], rpt[1]);
+		exit(0);
+	}
+
+	close(node->fd);
+	free(node);
+	close(ctl[0]);
+	close(rpt[1]);
+
+	sock = qrtr_socket();
+	if (sock < 0)
+		err(1, "creating AF_QIPCRTR socket failed");
+
+	cpu_start = cpu_time_ns();
+	start = time_ns();
+	end = start + duration * 1000000000ull;
+
+	do {
+		n = qrtr_sendto(sock, payload, size, 0, &sq);
+		if (n < 0)
+			err(1, "failed to send to %d:%d", sq.sq_node, sq.sq_port);
+
+		sent++;
+		now = time_ns();
+	} while (now < end);
+
+	qrtr_close(sock);
+	close(ctl[1]);
+
+	n = read(rpt[0], &res, sizeof(res));
+	if (n != sizeof(res))
+		errx(1, "remote failed to report result");
+
+	close(rpt[0]);
+	wait(NULL);
+
+	if (res.msgs != sent)
+		warnx("sent %llu messages, remote received %llu",
+		      (unsigned long long)sent, (unsigned long long)res.msgs);
+
+	if (res.corrupt) {
+		warnx("%llu of %llu messages of %zu bytes corrupted",
+		      (unsigned long long)res.corrupt, (unsigned long long)res.msgs, size);
+		metric_count("corrupt", res.corrupt);
+	}
+
+	report("tx", size, res.msgs, now - start, cpu_time_ns() - cpu_start, res.cpu_ns);
+}
+
+static void wait_resume_tx_uring(struct qrtr_node *node)
+{
+	struct qrtr_capture *cap = qrtr_node_capture();
+	struct qrtr_uring_pkt pkts[URING_BATCH];
+	struct qrtr_hdr_v1 *hdr;
+	bool resumed = false;
+	int ret;
+	int i;
+
+	while (!resumed) {
+		ret = qrtr_uring_recv(node->uring, pkts, URING_BATCH, 5000);
+		if (ret < 0)
+			err(1, "[remote] failed to read");
+		if (!ret)
+			errx(1, "[remote] no resume tx received");
+
+		for (i = 0; i < ret; i++) {
+			if (cap)
+				qrtr_capture(cap, QRTR_CAPTURE_RX, pkts[i].data, pkts[i].len);
+
+			hdr = pkts[i].data;
+			if (pkts[i].len >= sizeof(*hdr) && hdr->type == QRTR_TYPE_RESUME_TX)
+				resumed = true;
+
+			qrtr_uring_release(node->uring, &pkts[i]);
+		}
+	}
+}
+
+static void wait_resume_tx(struct qrtr_node *node)
+{
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd;
+	int type;
+	int ret;
+
+	if (node->uring) {
+		wait_resume_tx_uring(node);
+		return;
+	}
+
+	pfd.fd = node->fd;
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll(&pfd, 1, 5000);
+		if (ret < 0)
+			err(1, "[remote] poll failed");
+		if (!ret)
+			errx(1, "[remote] no resume tx received");
+
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
+			err(1, "[remote] failed to read");
+
+		type = pkt->hdr->type;
+		qrtr_pkt_put(pkt);
+	} while (type != QRTR_TYPE_RESUME_TX);
+}
+
+static void rx_remote(struct qrtr_node *node, struct sockaddr_qrtr *local_sq,
+		      size_t size, int res_fd)
+{
+	struct qrtr_tx_desc descs[FLOW_H];
+	struct qrtr_tx_template tmpl;
+	struct bench_result res = {};
+	uint64_t end;
+	ssize_t n;
+	int i;
+
+	if (qrtr_tx_template_init(&tmpl, node, REMOTE_PORT, local_sq) < 0)
+		err(1, "[remote] failed to encode header");
+
+	/* Each batch fills the flow control window */
+	for (i = 0; i < FLOW_H; i++) {
+		descs[i].tmpl = &tmpl;
+		descs[i].data = payload;
+		descs[i].len = size;
+		descs[i].confirm_rx = i == FLOW_L;
+	}
+
+	end = time_ns() + duration * 1000000000ull;
+
+	while (time_ns() < end) {
+		n = qrtr_node_send_batch(node, descs, FLOW_H);
+		if (n != FLOW_H)
+			err(1, "[remote] send data failed");
+
+		res.msgs += n;
+
+		wait_resume_tx(node);
+	}
+
+	res.cpu_ns = cpu_time_ns();
+
+	n = write(res_fd, &res, sizeof(res));
+	if (n != sizeof(res))
+		err(1, "[remote] failed to report result");
+}
+
+static void bench_rx(size_t size)
+{
+	struct sockaddr_qrtr sq;
+	struct bench_result res;
+	struct qrtr_node *node;
+	struct pollfd pfd[2];
+	static char buf[MAX_PAYLOAD];
+	uint64_t received = 0;
+	uint64_t corrupt = 0;
+	uint64_t cpu_start;
+	uint64_t start;
+	int rpt[2];
+	ssize_t n;
+	int sock;
+	int pid;
+	int ret;
+
+	sock = qrtr_socket();
+	if (sock < 0)
+		err(1, "creating AF_QIPCRTR socket failed");
+
+	sq.sq_family = AF_QIPCRTR;
+	sq.sq_node = 1;
+	sq.sq_port = 0;
+	ret = qrtr_bind(sock, &sq);
+	if (ret < 0)
+		err(1, "bind failed");
+
+	ret = qrtr_getsockname(sock, &sq);
+	if (ret < 0)
+		err(1, "getsockname failed");
+
+	if (pipe(rpt) < 0)
+		err(1, "failed to create pipe");
+
+	node = open_remote();
+
+	cpu_start = cpu_time_ns();
+	start = time_ns();
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		err(1, "fork failed");
+	case 0:
+		qrtr_close(sock);
+		close(rpt[0]);
+		remote_use_uring(node);
+		rx_remote(node, &sq, size, rpt[1]);
+		exit(0);
+	}
+
+	close(node->fd);
+	free(node);
+	close(rpt[1]);
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = rpt[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		ret = poll(pfd, 2, -1);
+		if (ret < 0)
+			err(1, "poll failed");
+
+		if (pfd[0].revents & POLLIN) {
+			n = qrtr_recvfrom(sock, buf, sizeof(buf), 0, NULL);
+			if (n < 0)
+				err(1, "failed to receive message");
+
+			if (!payload_ok(buf, n, size))
+				corrupt++;
+
+			received++;
+		}
+
+		if (pfd[1].revents)
+			break;
+	}
+
+	n = read(rpt[0], &res, sizeof(res));
+	if (n != sizeof(res))
+		errx(1, "remote failed to report result");
+
+	/* Pick up whatever is still in flight towards the socket */
+	pfd[0].revents = 0;
+	while (poll(pfd, 1, 100) > 0) {
+		n = qrtr_recvfrom(sock, buf, sizeof(buf), MSG_DONTWAIT, NULL);
+		if (n < 0)
+			break;
+
+		if (!payload_ok(buf, n, size))
+			corrupt++;
+
+		received++;
+	}
+
+	close(rpt[0]);
+	qrtr_close(sock);
+	wait(NULL);
+
+	if (received != res.msgs)
+		warnx("remote sent %llu messages, received %llu",
+		      (unsigned long long)res.msgs, (unsigned long long)received);
+
+	if (corrupt) {
+		warnx("%llu of %llu messages of %zu bytes corrupted",
+		      (unsigned long long)corrupt, (unsigned long long)received, size);
+		metric_count("corrupt", corrupt);
+	}
+
+	report("rx", size, received, time_ns() - start, cpu_time_ns() - cpu_start, res.cpu_ns);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-bench [-d seconds] [-m tx|rx|both] [-n] [-u depth] [-V 1|2] [-s size]...\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t sizes[MAX_SIZES];
+	unsigned nsizes = 0;
+	bool do_tx = true;
+	bool do_rx = true;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:m:ns:u:V:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'm':
+			do_tx = !strcmp(optarg, "tx") || !strcmp(optarg, "both");
+			do_rx = !strcmp(optarg, "rx") || !strcmp(optarg, "both");
+			if (!do_tx && !do_rx)
+				usage();
+			break;
+		case 'n':
+			verify = false;
+			break;
+		case 's':
+			if (nsizes == MAX_SIZES)
+				errx(1, "too many sizes, max %d", MAX_SIZES);
+			sizes[nsizes] = strtoul(optarg, NULL, 0);
+			if (!sizes[nsizes] || sizes[nsizes] > MAX_PAYLOAD)
+				errx(1, "size must be in range [1, %d]", MAX_PAYLOAD);
+			nsizes++;
+			break;
+		case 'u':
+			uring_depth = atoi(optarg);
+			break;
+		case 'V':
+			if (!strcmp(optarg, "1"))
+				hdr_version = QRTR_PROTO_VER_1;
+			else if (!strcmp(optarg, "2"))
+				hdr_version = QRTR_PROTO_VER_2;
+			else
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!duration)
+		usage();
+
+	if (!nsizes) {
+		for (i = 0; i < ARRAY_SIZE(default_sizes); i++)
+			sizes[i] = default_sizes[i];
+		nsizes = ARRAY_SIZE(default_sizes);
+	}
+
+	printf("%-3s %6s %10s %12s %10s %10s %10s %8s\n",
+	       "dir", "size", "msgs", "msgs/s", "MB/s", "cpu ns", "rmt ns", "ns/B");
+	fflush(stdout);
+
+	for (i = 0; i < nsizes; i++) {
+		payload_fill(sizes[i]);
+
+		if (do_tx)
+			bench_tx(sizes[i]);
+		if (do_rx)
+			bench_rx(sizes[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,451 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qrtr-capture.h"
+#include "util.h"
+
+/*
+ * Packet capture into a memory mapped pcapng file.
+ *
+ * The file starts with a section header and a single interface description,
+ * followed by a fixed size ring of Enhanced Packet Blocks carrying a
+ * nanosecond timestamp and the direction in the epb_flags option. Recording a
+ * packet is a clock read and a copy into the mapping; once the ring is full
+ * the oldest packets are overwritten.
+ *
+ * While running the ring may have wrapped, so the file is only a valid pcapng
+ * file after qrtr_capture_close() has rotated the ring into order and
+ * truncated the file to the captured packets.
+ *
+ * There's no link type allocated for QRTR, so LINKTYPE_USER0 is used and the
+ * packets start with the v1 header as seen on qrtr-tun.
+ *
+ * qrtr_capture_load() reads such files back, as well as classic pcap files,
+ * for the replay and analysis tools.
+ */
+
+#define LINKTYPE_USER0		147
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+
+#define OPT_ENDOFOPT		0
+#define OPT_IF_TSRESOL		9
+#define OPT_EPB_FLAGS		2
+
+#define ALIGN4(x)		(((x) + 3) & ~(size_t)3)
+
+/* Fixed part, flags option and end of options, and trailing length */
+#define EPB_OVERHEAD		(28 + 12 + 4)
+
+struct pcapng_shb {
+	uint32_t type;
+	uint32_t len;
+	uint32_t byte_order;
+	uint16_t major;
+	uint16_t minor;
+	int64_t section_len;
+	uint32_t len2;
+} __packed;
+
+struct pcapng_idb {
+	uint32_t type;
+	uint32_t len;
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+	uint16_t tsresol_code;
+	uint16_t tsresol_len;
+	uint8_t tsresol;
+	uint8_t pad[3];
+	uint32_t end_of_opt;
+	uint32_t len2;
+} __packed;
+
+struct pcapng_epb {
+	uint32_t type;
+	uint32_t len;
+	uint32_t interface;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t origlen;
+} __packed;
+
+struct qrtr_capture {
+	int fd;
+
+	void *map;
+	size_t map_len;
+
+	char *ring;
+	size_t size;
+
+	/* Valid data is [tail, wrap) followed by [0, head) once wrapped */
+	size_t head;
+	size_t tail;
+	size_t wrap;
+	bool wrapped;
+};
+
+struct qrtr_capture *qrtr_capture_open(const char *path, size_t ring_size)
+{
+	struct qrtr_capture *cap;
+	struct pcapng_shb *shb;
+	struct pcapng_idb *idb;
+	int saved_errno;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return NULL;
+
+	cap->size = ALIGN4(ring_size);
+	cap->map_len = sizeof(*shb) + sizeof(*idb) + cap->size;
+	cap->map = MAP_FAILED;
+
+	cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap->fd < 0)
+		goto err;
+
+	if (ftruncate(cap->fd, cap->map_len) < 0)
+		goto err;
+
+	cap->map = mmap(NULL, cap->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, cap->fd, 0);
+	if (cap->map == MAP_FAILED)
+		goto err;
+
+	shb = cap->map;
+	shb->type = PCAPNG_SHB;
+	shb->len = sizeof(*shb);
+	shb->byte_order = PCAPNG_BYTE_ORDER;
+	shb->major = 1;
+	shb->minor = 0;
+	shb->section_len = -1;
+	shb->len2 = sizeof(*shb);
+
+	idb = (struct pcapng_idb *)(shb + 1);
+	memset(idb, 0, sizeof(*idb));
+	idb->type = PCAPNG_IDB;
+	idb->len = sizeof(*idb);
+	idb->linktype = LINKTYPE_USER0;
+	idb->tsresol_code = OPT_IF_TSRESOL;
+	idb->tsresol_len = 1;
+	idb->tsresol = 9;
+	idb->end_of_opt = OPT_ENDOFOPT;
+	idb->len2 = sizeof(*idb);
+
+	cap->ring = (char *)(idb + 1);
+
+	return cap;
+
+err:
+	saved_errno = errno;
+	if (cap->fd >= 0)
+		close(cap->fd);
+	free(cap);
+	errno = saved_errno;
+	return NULL;
+}
+
+static uint32_t block_len(struct qrtr_capture *cap, size_t offset)
+{
+	uint32_t len;
+
+	memcpy(&len, cap->ring + offset + 4, sizeof(len));
+
+	return len;
+}
+
+/* Make room for len bytes at head, dropping the oldest packets as needed */
+static void make_room(struct qrtr_capture *cap, size_t len)
+{
+	if (cap->head + len > cap->size) {
+		cap->wrap = cap->head;
+		cap->head = 0;
+		cap->tail = 0;
+		cap->wrapped = true;
+	}
+
+	if (!cap->wrapped)
+		return;
+
+	while (cap->tail < cap->head + len) {
+		cap->tail += block_len(cap, cap->tail);
+		if (cap->tail >= cap->wrap) {
+			cap->tail = 0;
+			cap->wrapped = false;
+			break;
+		}
+	}
+}
+
+void qrtr_capture_iov(struct qrtr_capture *cap, int dir, const struct iovec *iov, int iovcnt)
+{
+	struct pcapng_epb epb;
+	struct timespec ts;
+	uint32_t opt[3];
+	size_t data_len = 0;
+	size_t len;
+	uint64_t t;
+	char *p;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		data_len += iov[i].iov_len;
+
+	len = EPB_OVERHEAD + ALIGN4(data_len);
+	if (len > cap->size / 2)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	make_room(cap, len);
+
+	epb.type = PCAPNG_EPB;
+	epb.len = len;
+	epb.interface = 0;
+	epb.ts_high = t >> 32;
+	epb.ts_low = t;
+	epb.caplen = data_len;
+	epb.origlen = data_len;
+
+	p = cap->ring + cap->head;
+	memcpy(p, &epb, sizeof(epb));
+	p += sizeof(epb);
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	memset(p, 0, ALIGN4(data_len) - data_len);
+	p += ALIGN4(data_len) - data_len;
+
+	opt[0] = OPT_EPB_FLAGS | 4 << 16;
+	opt[1] = dir;
+	opt[2] = OPT_ENDOFOPT;
+	memcpy(p, opt, sizeof(opt));
+	p += sizeof(opt);
+
+	memcpy(p, &epb.len, sizeof(epb.len));
+
+	cap->head += len;
+}
+
+void qrtr_capture(struct qrtr_capture *cap, int dir, const void *buf, size_t len)
+{
+	struct iovec iov = { (void *)buf, len };
+
+	qrtr_capture_iov(cap, dir, &iov, 1);
+}
+
+/* Bring the ring in order, oldest packet first, and trim the file */
+static size_t linearize(struct qrtr_capture *cap)
+{
+	size_t old_len;
+	char *tmp;
+
+	if (!cap->wrapped)
+		return cap->head;
+
+	old_len = cap->wrap - cap->tail;
+
+	tmp = malloc(cap->head);
+	if (!tmp)
+		return 0;
+
+	memcpy(tmp, cap->ring, cap->head);
+	memmove(cap->ring, cap->ring + cap->tail, old_len);
+	memcpy(cap->ring + old_len, tmp, cap->head);
+	free(tmp);
+
+	return old_len + cap->head;
+}
+
+void qrtr_capture_close(struct qrtr_capture *cap)
+{
+	size_t used;
+
+	if (!cap)
+		return;
+
+	used = linearize(cap);
+
+	munmap(cap->map, cap->map_len);
+
+	if (ftruncate(cap->fd, cap->map_len - cap->size + used) < 0)
+		warn("failed to truncate capture file");
+
+	close(cap->fd);
+	free(cap);
+}
+
+static uint64_t tsresol_scale(uint8_t tsresol)
+{
+	uint64_t scale = 1;
+	int i;
+
+	/* Only decimal resolutions down to nanoseconds are handled */
+	if (tsresol & 0x80 || tsresol > 9)
+		errx(1, "unsupported timestamp resolution %#x", tsresol);
+
+	for (i = tsresol; i < 9; i++)
+		scale *= 10;
+
+	return scale;
+}
+
+static void parse_pcapng(const char *buf, size_t size, qrtr_capture_cb cb, void *data)
+{
+	uint64_t scale = 1000;
+	const char *opt;
+	const char *end;
+	uint32_t caplen;
+	uint32_t type;
+	uint32_t len;
+	uint16_t code;
+	uint16_t olen;
+	uint32_t flags;
+	uint64_t ts;
+	size_t off = 0;
+
+	while (off + 12 <= size) {
+		memcpy(&type, buf + off, 4);
+		memcpy(&len, buf + off + 4, 4);
+		if (len < 12 || len % 4 || off + len > size)
+			errx(1, "malformed pcapng block at %zu", off);
+
+		switch (type) {
+		case PCAPNG_SHB:
+			if (*(uint32_t *)(buf + off + 8) != PCAPNG_BYTE_ORDER)
+				errx(1, "only native byte order pcapng files supported");
+			break;
+		case PCAPNG_IDB:
+			if (*(uint16_t *)(buf + off + 8) != LINKTYPE_USER0)
+				warnx("unexpected link type %u, assuming QRTR",
+				      *(uint16_t *)(buf + off + 8));
+
+			scale = 1000;
+			opt = buf + off + 16;
+			end = buf + off + len - 4;
+			while (opt + 4 <= end) {
+				memcpy(&code, opt, 2);
+				memcpy(&olen, opt + 2, 2);
+				if (code == OPT_ENDOFOPT)
+					break;
+				if (code == OPT_IF_TSRESOL)
+					scale = tsresol_scale(opt[4]);
+				opt += 4 + ALIGN4(olen);
+			}
+			break;
+		case PCAPNG_EPB:
+			ts = (uint64_t)*(uint32_t *)(buf + off + 12) << 32 |
+			     *(uint32_t *)(buf + off + 16);
+			caplen = *(uint32_t *)(buf + off + 20);
+			if (28 + caplen > len)
+				errx(1, "malformed packet block at %zu", off);
+
+			flags = 0;
+			opt = buf + off + 28 + ALIGN4(caplen);
+			end = buf + off + len - 4;
+			while (opt + 4 <= end) {
+				memcpy(&code, opt, 2);
+				memcpy(&olen, opt + 2, 2);
+				if (code == OPT_ENDOFOPT)
+					break;
+				if (code == OPT_EPB_FLAGS && olen == 4)
+					memcpy(&flags, opt + 4, 4);
+				opt += 4 + ALIGN4(olen);
+			}
+
+			cb(ts * scale, buf + off + 28, caplen, flags & 3, data);
+			break;
+		}
+
+		off += len;
+	}
+}
+
+static void parse_pcap(const char *buf, size_t size, qrtr_capture_cb cb, void *data)
+{
+	uint32_t magic = *(uint32_t *)buf;
+	uint32_t scale = magic == PCAP_MAGIC_NSEC ? 1 : 1000;
+	const uint32_t *rec;
+	size_t off = 24;
+	uint64_t ts;
+
+	if (*(uint32_t *)(buf + 20) != LINKTYPE_USER0)
+		warnx("unexpected link type %u, assuming QRTR", *(uint32_t *)(buf + 20));
+
+	while (off + 16 <= size) {
+		rec = (const uint32_t *)(buf + off);
+		if (off + 16 + rec[2] > size)
+			errx(1, "truncated pcap record at %zu", off);
+
+		ts = rec[0] * 1000000000ull + rec[1] * scale;
+		cb(ts, buf + off + 16, rec[2], 0, data);
+
+		off += 16 + rec[2];
+	}
+}
+
+/*
+ * Map the pcapng, or classic pcap, capture at @path and pass each packet in
+ * it to @cb, in file order. The packets point into the mapping, which is kept
+ * for the lifetime of the process. Malformed files are fatal.
+ */
+void qrtr_capture_load(const char *path, qrtr_capture_cb cb, void *data)
+{
+	struct stat sb;
+	uint32_t magic;
+	void *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(1, "failed to open %s", path);
+
+	if (fstat(fd, &sb) < 0)
+		err(1, "failed to stat %s", path);
+
+	if (sb.st_size < 24)
+		errx(1, "%s is not a capture file", path);
+
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		err(1, "failed to map %s", path);
+
+	madvise(buf, sb.st_size, MADV_SEQUENTIAL);
+
+	close(fd);
+
+	magic = *(uint32_t *)buf;
+	switch (magic) {
+	case PCAPNG_SHB:
+		parse_pcapng(buf, sb.st_size, cb, data);
+		break;
+	case PCAP_MAGIC_USEC:
+	case PCAP_MAGIC_NSEC:
+		parse_pcap(buf, sb.st_size, cb, data);
+		break;
+	default:
+		errx(1, "%s: unknown capture format %#x", path, magic);
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef __QRTR_CAPTURE_H__
+#define __QRTR_CAPTURE_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#define QRTR_CAPTURE_ENV	"QRTR_CAPTURE"
+
+/* Matches the direction bits of the pcapng epb_flags option */
+enum {
+	QRTR_CAPTURE_RX = 1,
+	QRTR_CAPTURE_TX = 2,
+};
+
+struct qrtr_capture;
+
+typedef void (*qrtr_capture_cb)(uint64_t ts, const void *pkt, size_t len, int dir, void *data);
+
+struct qrtr_capture *qrtr_capture_open(const char *path, size_t ring_size);
+void qrtr_capture_close(struct qrtr_capture *cap);
+
+void qrtr_capture_iov(struct qrtr_capture *cap, int dir, const struct iovec *iov, int iovcnt);
+void qrtr_capture(struct qrtr_capture *cap, int dir, const void *buf, size_t len);
+
+void qrtr_capture_load(const char *path, qrtr_capture_cb cb, void *data);
+
+#endif
@@ -3,8 +3,11 @@
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -12,6 +15,9 @@
 
 #include "qrtr.h"
 #include "qrtr-test.h"
+#include "qrtr-memstat.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
 #include "util.h"
 
 /*
@@ -26,141 +32,370 @@
  * the range [100, 110) and count the maximum number of packets between
  * confirm_rx.
  *
+ * With -n and -p the traffic is instead spread over a number of remote nodes
+ * times a number of ports, e.g. -n 64 -p 512 -c 1000000 for ~32k destinations.
+ * Depth is tracked per exact (node, port) destination in an open addressing
+ * table, and the distribution of depth between confirm_rx packets is printed.
+ *
  * As the limit is sender-defined and only given a recomended value of 10 we
  * compare with the arbitrary limit of 20 here.
+ *
+ * With -i the remote misbehaves and never answers confirm_rx with a
+ * RESUME_TX. The local side then sends with MSG_DONTWAIT and moves on when a
+ * destination is blocked, and the test checks that no destination was sent
+ * more than the limit in total.
+ *
+ * Throughout the run the kernel's memory use is sampled every -m ms, see
+ * qrtr-memstat.c, and the peak and per packet cost reported.
  */
 
 #define TEST_SIZE	1000
 
 #define MAX_DEPTH	20
 
-#define REMOTE_NODE	100
+#define MEM_INTERVAL	10
+
+struct flow {
+	uint64_t key;
+	unsigned int count;
+	unsigned int total;
+	unsigned int max_depth;
+};
+
+struct flow_table {
+	struct flow *flows;
+	unsigned int mask;
+	unsigned int used;
+	unsigned long probes;
+	unsigned long lookups;
+};
+
+static unsigned int node_count = 1;
+static unsigned int port_count = 10;
+static unsigned long test_size = TEST_SIZE;
+static unsigned int mem_interval = MEM_INTERVAL;
+static bool ignore_confirm;
+
+static void flow_table_init(struct flow_table *table, unsigned int entries)
+{
+	unsigned int size = 16;
+
+	/* Keep the load factor at or below 0.5 */
+	while (size < 2 * entries)
+		size <<= 1;
 
-static int run_receiver(struct qrtr_node *node)
+	table->flows = calloc(size, sizeof(*table->flows));
+	if (!table->flows)
+		err(1, "failed to allocate flow table");
+
+	table->mask = size - 1;
+	table->used = 0;
+	table->probes = 0;
+	table->lookups = 0;
+}
+
+/* Find, or insert, the flow of @node:@port; node ids are never 0 */
+static struct flow *flow_lookup(struct flow_table *table, unsigned int node,
+				unsigned int port)
 {
-	struct qrtr_hdr_v1 hdr;
-	struct iovec iov[2];
+	uint64_t key = (uint64_t)node << 32 | port;
+	unsigned int idx;
+	struct flow *flow;
+
+	idx = (key * 0x9e3779b97f4a7c15ull) >> 32 & table->mask;
+
+	table->lookups++;
+	for (;;) {
+		table->probes++;
+
+		flow = &table->flows[idx];
+		if (flow->key == key)
+			return flow;
+
+		if (!flow->key)
+			break;
+
+		idx = (idx + 1) & table->mask;
+	}
+
+	if (table->used == table->mask)
+		errx(1, "[remote] flow table full");
+
+	flow->key = key;
+	table->used++;
+
+	return flow;
+}
+
+static int run_receiver(struct qrtr_node *node, int ctl_fd)
+{
+	unsigned long dist[MAX_DEPTH + 1] = {};
+	unsigned long flow_dist[MAX_DEPTH + 1] = {};
+	struct histogram *confirm_hist = metric_hist("confirm_rx_depth", "packets");
+	struct histogram *flow_hist = metric_hist("flow_max_depth", "packets");
+	struct flow_table table;
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
 	struct timeval tv;
-	unsigned depth[10] = {};
-	unsigned count[10] = {};
+	struct flow *flow;
 	unsigned max_depth = 0;
-	char buf[8192];
+	unsigned max_total = 0;
+	unsigned long packets = 0;
+	unsigned long expected = test_size;
+	uint64_t cpu_ns;
 	fd_set rset;
 	int tun_fd = node->fd;
 	ssize_t n;
-	int bucket;
 	int i;
 
-	iov[0].iov_base = &hdr;
-	iov[0].iov_len = sizeof(hdr);
+	flow_table_init(&table, node_count * port_count);
 
-	iov[1].iov_base = buf;
-	iov[1].iov_len = sizeof(buf);
+	cpu_ns = cpu_time_ns();
 
-	for (;;) {
+	/*
+	 * Stop once all messages have arrived; the sender reports how many it
+	 * got through once done, which with -i is less than it attempted.
+	 */
+	while (packets < expected) {
 		FD_ZERO(&rset);
 		FD_SET(tun_fd, &rset);
+		if (ctl_fd >= 0)
+			FD_SET(ctl_fd, &rset);
 
 		tv.tv_sec = 5;
 		tv.tv_usec = 0;
 
-		n = select(tun_fd + 1, &rset, NULL, NULL, &tv);
+		n = select(MAX(tun_fd, ctl_fd) + 1, &rset, NULL, NULL, &tv);
 		if (n < 0)
 			err(1, "[remote] select failed");
 
-		if (!n)
+		if (!n) {
+			warnx("[remote] timed out after %lu of %lu messages", packets, expected);
 			break;
+		}
+
+		if (ctl_fd >= 0 && FD_ISSET(ctl_fd, &rset)) {
+			n = read(ctl_fd, &expected, sizeof(expected));
+			if (n != sizeof(expected))
+				errx(1, "[remote] sender failed to report its count");
+
+			close(ctl_fd);
+			ctl_fd = -1;
+		}
 
 		if (!FD_ISSET(tun_fd, &rset))
 			continue;
 
-		n = readv(tun_fd, iov, 2);
-		if (n < (int)sizeof(hdr))
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
 			err(1, "[remote] failed to read");
 
-		if (hdr.type == QRTR_TYPE_DATA) {
-			bucket = hdr.dst_port_id % 10;
+		hdr = pkt->hdr;
 
-			count[bucket]++;
+		if (hdr->type == QRTR_TYPE_DATA) {
+			flow = flow_lookup(&table, hdr->dst_node_id, hdr->dst_port_id);
 
-			depth[bucket] = MAX(count[bucket], depth[bucket]);
+			flow->count++;
+			flow->total++;
+			packets++;
 
-			if (hdr.confirm_rx) {
-				count[bucket] = 0;
+			flow->max_depth = MAX(flow->count, flow->max_depth);
 
-				qrtr_resume_tx(node, hdr.dst_node_id, hdr.dst_port_id, hdr.src_node_id, hdr.src_port_id);
+			if (hdr->confirm_rx) {
+				dist[MIN(flow->count, MAX_DEPTH)]++;
+				hist_record(confirm_hist, flow->count);
+				flow->count = 0;
+
+				if (!ignore_confirm)
+					qrtr_resume_tx(node, hdr->dst_node_id, hdr->dst_port_id, hdr->src_node_id, hdr->src_port_id);
 			}
 		}
+
+		qrtr_pkt_put(pkt);
 	}
 
-	printf("buckets:");
-	for (i = 0; i < 10; i++) {
-		printf(" %d", depth[i]);
-		max_depth = MAX(max_depth, depth[i]);
+	cpu_ns = cpu_time_ns() - cpu_ns;
+
+	for (i = 0; i <= table.mask; i++) {
+		flow = &table.flows[i];
+		if (!flow->key)
+			continue;
+
+		flow_dist[MIN(flow->max_depth, MAX_DEPTH)]++;
+		hist_record(flow_hist, flow->max_depth);
+		max_depth = MAX(max_depth, flow->max_depth);
+		max_total = MAX(max_total, flow->total);
+	}
+
+	metric_count("received", packets);
+	metric_gauge("destinations", table.used);
+	metric_gauge("probes_per_lookup", table.lookups ? (double)table.probes / table.lookups : 0.0);
+	metric_gauge("cpu_ns_per_msg", packets ? (double)cpu_ns / packets : 0.0);
+
+	printf("received %lu messages on %u destinations\n", packets, table.used);
+	printf("flow table: %u slots, %.2f probes per lookup, %lu cpu ns per message\n",
+	       table.mask + 1,
+	       table.lookups ? (double)table.probes / table.lookups : 0.0,
+	       packets ? (unsigned long)(cpu_ns / packets) : 0);
+
+	printf("%5s %12s %12s\n", "depth", "confirm_rx", "flows");
+	for (i = 1; i <= MAX_DEPTH; i++) {
+		if (!dist[i] && !flow_dist[i])
+			continue;
+
+		printf("%4d%s %12lu %12lu\n", i, i == MAX_DEPTH ? "+" : " ",
+		       dist[i], flow_dist[i]);
 	}
-	printf("\n");
 
 	printf("max depth: %d\n", max_depth);
 
-	return max_depth < MAX_DEPTH ? 0 : 1;
+	/* Without any RESUME_TX no destination may get more than a window */
+	if (ignore_confirm) {
+		printf("max per destination without resume: %u\n", max_total);
+		if (max_total >= MAX_DEPTH)
+			return 1;
+	}
+
+	return max_depth < MAX_DEPTH && packets == expected ? 0 : 1;
 }
 
-static int run_transmitter(void)
+static int run_transmitter(int ctl_fd)
 {
-	struct sockaddr_qrtr sq = { AF_QIPCRTR, REMOTE_NODE };
+	struct sockaddr_qrtr sq = { AF_QIPCRTR };
+	struct qrtr_memstat *ms = NULL;
 	const char ping[] = "ping";
-	unsigned sent = 0;
+	unsigned long blocked = 0;
+	unsigned long sent = 0;
+	unsigned long i;
 	ssize_t n;
 	int status;
 	int sock;
-	int i;
 
-	sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	sock = qrtr_socket();
 	if (sock < 0)
 		err(1, "creating AF_QIPCRTR socket failed");
 
-	for (i = 0; i < TEST_SIZE; i++) {
-		sq.sq_port = 100 + rand() % 10;
+	if (mem_interval)
+		ms = qrtr_memstat_start(mem_interval, &sock, 1);
+
+	for (i = 0; i < test_size; i++) {
+		sq.sq_node = qrtr_test_node(rand() % node_count);
+		sq.sq_port = qrtr_test_port(rand() % port_count);
 
-		n = sendto(sock, ping, 4, 0, (void *)&sq, sizeof(sq));
+		n = qrtr_sendto(sock, ping, 4, ignore_confirm ? MSG_DONTWAIT : 0, &sq);
+		if (n < 0 && ignore_confirm && errno == EAGAIN) {
+			blocked++;
+			continue;
+		}
 		if (n < 0)
 			err(1, "failed to send ping to %d", sq.sq_node);
 
 		sent++;
 	}
 
-	printf("sent %d messages\n", sent);
+	/* The remote may already be done, having received everything */
+	signal(SIGPIPE, SIG_IGN);
+	n = write(ctl_fd, &sent, sizeof(sent));
+	if (n < 0 && errno != EPIPE)
+		err(1, "failed to report count to remote");
+	close(ctl_fd);
+
+	metric_count("sent", sent);
+	metric_count("blocked", blocked);
+	printf("sent %lu messages", sent);
+	if (ignore_confirm)
+		printf(", %lu blocked", blocked);
+	printf("\n");
 
 	wait(&status);
 
+	if (ms)
+		qrtr_memstat_stop(ms, sent);
+
+	qrtr_close(sock);
+
 	return WEXITSTATUS(status);
 }
 
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-confirm-rx-usage [-n nodes] [-p ports] [-c count] [-i] [-m interval-ms]\n");
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
 	struct qrtr_node *node;
+	int ctl[2];
 	int tun_fd;
+	int opt;
 	int pid;
 	int ret;
+	int i;
+
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "c:im:n:p:")) != -1) {
+		switch (opt) {
+		case 'c':
+			test_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			ignore_confirm = true;
+			break;
+		case 'm':
+			mem_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			node_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			port_count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
 
-	tun_fd = open("/dev/qrtr-tun", O_RDWR);
+	if (!node_count || !port_count)
+		usage();
+
+	tun_fd = qrtr_tun_open();
 	if (tun_fd < 0)
 		err(1, "failed to open qrtr-tun");
 
-	node = qrtr_node_new(REMOTE_NODE, tun_fd);
+	node = qrtr_node_new(qrtr_test_node(0), tun_fd);
 
 	ret = qrtr_node_hello(node);
 	if (ret < 0)
 		err(1, "failed to hello");
 
+	/* Any additional remote nodes share the endpoint of the first one */
+	for (i = 1; i < node_count; i++) {
+		struct qrtr_node extra = {
+			.node_id = qrtr_test_node(i),
+			.fd = tun_fd,
+			.version = QRTR_PROTO_VER_1,
+		};
+
+		ret = qrtr_node_hello(&extra);
+		if (ret < 0)
+			err(1, "failed to hello node %d", extra.node_id);
+	}
+
+	if (pipe(ctl) < 0)
+		err(1, "failed to create pipe");
+
 	pid = fork();
 	switch (pid) {
 	case -1:
 		err(1, "fork failed");
 	case 0:
-		return run_receiver(node);
+		close(ctl[1]);
+		return run_receiver(node, ctl[0]);
 	default:
+		close(ctl[0]);
 		close(tun_fd);
-		return run_transmitter();
+		return run_transmitter(ctl[1]);
 	}
 }
@@ -0,0 +1,276 @@
+#ifndef __QRTR_HDR_H__
+#define __QRTR_HDR_H__
+
+#include <sys/types.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "qrtr.h"
+
+/*
+ * Encoding and decoding of the QRTR packet header.
+ *
+ * Version 1 is the 32 byte header of all __le32 fields, which the kernel
+ * always uses on transmit. Version 2 is a compact 16 byte header with 16-bit
+ * node and port ids, confirm_rx carried as a flag, and optionally followed by
+ * optlen bytes of extended header, which the kernel skips. The control port
+ * and broadcast node are sent as their 16-bit truncations; like the kernel,
+ * only the control port is mapped back when decoding, node 0xffff is just
+ * that.
+ *
+ * The per version helpers are always inlined and the generic ones take the
+ * version as their first argument, so callers passing a constant get the
+ * encoder or decoder of that version without any dispatch; see
+ * qrtr_node_send_batch() for an example.
+ */
+
+#define QRTR_PROTO_VER_1	1
+#define QRTR_PROTO_VER_2	3
+
+#define QRTR_FLAGS_CONFIRM_RX	(1 << 0)
+
+/* Largest payload the kernel accepts from an AF_QIPCRTR socket */
+#define QRTR_MAX_PAYLOAD	65535
+
+/* The extended header is kept a multiple of 4, like the payload */
+#define QRTR_HDR_V2_MAX_OPTLEN	252
+
+#define QRTR_HDR_MAX_LEN	(sizeof(struct qrtr_hdr_v2) + QRTR_HDR_V2_MAX_OPTLEN)
+
+#define QRTR_HDR_V2_MAX		0xffffu
+
+#define __qrtr_hdr_always_inline	inline __attribute__((__always_inline__))
+
+struct qrtr_hdr_v1 {
+	__le32 version;
+	__le32 type;
+	__le32 src_node_id;
+	__le32 src_port_id;
+	__le32 confirm_rx;
+	__le32 size;
+	__le32 dst_node_id;
+	__le32 dst_port_id;
+} __packed;
+
+struct qrtr_hdr_v2 {
+	uint8_t version;
+	uint8_t type;
+	uint8_t flags;
+	uint8_t optlen;
+	__le32 size;
+	__le16 src_node_id;
+	__le16 src_port_id;
+	__le16 dst_node_id;
+	__le16 dst_port_id;
+} __packed;
+
+_Static_assert(sizeof(struct qrtr_hdr_v2) == 16, "qrtr_hdr_v2 must be 16 bytes");
+
+/* Header fields in host byte order, independent of the version */
+struct qrtr_hdr_fields {
+	unsigned int version;
+	unsigned int type;
+	bool confirm_rx;
+
+	uint32_t src_node_id;
+	uint32_t src_port_id;
+	uint32_t dst_node_id;
+	uint32_t dst_port_id;
+
+	size_t size;
+
+	/* Extended header, v2 only */
+	const void *opt;
+	size_t optlen;
+};
+
+static __qrtr_hdr_always_inline size_t qrtr_hdr_len(unsigned int version, size_t optlen)
+{
+	if (version == QRTR_PROTO_VER_2)
+		return sizeof(struct qrtr_hdr_v2) + optlen;
+
+	return sizeof(struct qrtr_hdr_v1);
+}
+
+static __qrtr_hdr_always_inline bool qrtr_hdr_v2_node_ok(uint32_t node)
+{
+	return node <= QRTR_HDR_V2_MAX || node == QRTR_NODE_BCAST;
+}
+
+static __qrtr_hdr_always_inline bool qrtr_hdr_v2_port_ok(uint32_t port)
+{
+	return port <= QRTR_HDR_V2_MAX || port == QRTR_PORT_CTRL;
+}
+
+static __qrtr_hdr_always_inline uint32_t qrtr_hdr_v2_port_decode(__le16 port)
+{
+	uint16_t v = le16toh(port);
+
+	return v == (uint16_t)QRTR_PORT_CTRL ? QRTR_PORT_CTRL : v;
+}
+
+/*
+ * Write the header for @f into @buf, which must hold QRTR_HDR_MAX_LEN bytes.
+ * Returns the header length, or -1 with errno set to ERANGE if a field
+ * doesn't fit the format.
+ */
+static __qrtr_hdr_always_inline ssize_t qrtr_hdr_v1_encode(void *buf, const struct qrtr_hdr_fields *f)
+{
+	struct qrtr_hdr_v1 *hdr = buf;
+
+	hdr->version = htole32(QRTR_PROTO_VER_1);
+	hdr->type = htole32(f->type);
+	hdr->src_node_id = htole32(f->src_node_id);
+	hdr->src_port_id = htole32(f->src_port_id);
+	hdr->confirm_rx = htole32(!!f->confirm_rx);
+	hdr->size = htole32(f->size);
+	hdr->dst_node_id = htole32(f->dst_node_id);
+	hdr->dst_port_id = htole32(f->dst_port_id);
+
+	return sizeof(*hdr);
+}
+
+static __qrtr_hdr_always_inline ssize_t qrtr_hdr_v2_encode(void *buf, const struct qrtr_hdr_fields *f)
+{
+	struct qrtr_hdr_v2 *hdr = buf;
+
+	if (f->size > UINT32_MAX || f->optlen > QRTR_HDR_V2_MAX_OPTLEN || f->optlen % 4 ||
+	    !qrtr_hdr_v2_node_ok(f->src_node_id) || !qrtr_hdr_v2_port_ok(f->src_port_id) ||
+	    !qrtr_hdr_v2_node_ok(f->dst_node_id) || !qrtr_hdr_v2_port_ok(f->dst_port_id)) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	hdr->version = QRTR_PROTO_VER_2;
+	hdr->type = f->type;
+	hdr->flags = f->confirm_rx ? QRTR_FLAGS_CONFIRM_RX : 0;
+	hdr->optlen = f->optlen;
+	hdr->size = htole32(f->size);
+	hdr->src_node_id = htole16(f->src_node_id);
+	hdr->src_port_id = htole16(f->src_port_id);
+	hdr->dst_node_id = htole16(f->dst_node_id);
+	hdr->dst_port_id = htole16(f->dst_port_id);
+
+	if (f->optlen)
+		memcpy(hdr + 1, f->opt, f->optlen);
+
+	return sizeof(*hdr) + f->optlen;
+}
+
+static __qrtr_hdr_always_inline ssize_t qrtr_hdr_encode(unsigned int version, void *buf,
+							const struct qrtr_hdr_fields *f)
+{
+	if (version == QRTR_PROTO_VER_2)
+		return qrtr_hdr_v2_encode(buf, f);
+
+	return qrtr_hdr_v1_encode(buf, f);
+}
+
+/*
+ * Update size and confirm_rx of an already encoded header, for sending a
+ * stream of packets from one header template.
+ */
+static __qrtr_hdr_always_inline void qrtr_hdr_patch(unsigned int version, void *buf,
+						    size_t size, bool confirm_rx)
+{
+	struct qrtr_hdr_v1 *v1 = buf;
+	struct qrtr_hdr_v2 *v2 = buf;
+
+	if (version == QRTR_PROTO_VER_2) {
+		v2->size = htole32(size);
+		v2->flags = confirm_rx ? QRTR_FLAGS_CONFIRM_RX : 0;
+	} else {
+		v1->size = htole32(size);
+		v1->confirm_rx = htole32(!!confirm_rx);
+	}
+}
+
+static __qrtr_hdr_always_inline ssize_t qrtr_hdr_v1_decode(const void *buf, size_t len,
+							   struct qrtr_hdr_fields *f)
+{
+	const struct qrtr_hdr_v1 *hdr = buf;
+
+	if (len < sizeof(*hdr))
+		goto invalid;
+
+	f->version = QRTR_PROTO_VER_1;
+	f->type = le32toh(hdr->type);
+	f->confirm_rx = !!le32toh(hdr->confirm_rx);
+	f->src_node_id = le32toh(hdr->src_node_id);
+	f->src_port_id = le32toh(hdr->src_port_id);
+	f->dst_node_id = le32toh(hdr->dst_node_id);
+	f->dst_port_id = le32toh(hdr->dst_port_id);
+	f->size = le32toh(hdr->size);
+	f->opt = NULL;
+	f->optlen = 0;
+
+	if (f->size > len - sizeof(*hdr))
+		goto invalid;
+
+	return sizeof(*hdr);
+
+invalid:
+	errno = EMSGSIZE;
+	return -1;
+}
+
+static __qrtr_hdr_always_inline ssize_t qrtr_hdr_v2_decode(const void *buf, size_t len,
+							   struct qrtr_hdr_fields *f)
+{
+	const struct qrtr_hdr_v2 *hdr = buf;
+	size_t hdr_len;
+
+	if (len < sizeof(*hdr))
+		goto invalid;
+
+	hdr_len = sizeof(*hdr) + hdr->optlen;
+
+	f->version = QRTR_PROTO_VER_2;
+	f->type = hdr->type;
+	f->confirm_rx = !!(hdr->flags & QRTR_FLAGS_CONFIRM_RX);
+	f->src_node_id = le16toh(hdr->src_node_id);
+	f->src_port_id = qrtr_hdr_v2_port_decode(hdr->src_port_id);
+	f->dst_node_id = le16toh(hdr->dst_node_id);
+	f->dst_port_id = qrtr_hdr_v2_port_decode(hdr->dst_port_id);
+	f->size = le32toh(hdr->size);
+	f->opt = hdr + 1;
+	f->optlen = hdr->optlen;
+
+	if (hdr_len > len || f->size > len - hdr_len)
+		goto invalid;
+
+	return hdr_len;
+
+invalid:
+	errno = EMSGSIZE;
+	return -1;
+}
+
+/*
+ * Decode the header at the start of the @len byte packet in @buf, the payload
+ * follows at the returned offset. Returns -1 with errno set to EMSGSIZE if the
+ * packet is truncated, or EPROTO for an unknown version.
+ */
+static inline ssize_t qrtr_hdr_decode(const void *buf, size_t len, struct qrtr_hdr_fields *f)
+{
+	if (!len)
+		goto invalid;
+
+	/* The low byte of the v1 version field sits where the v2 one does */
+	switch (*(const uint8_t *)buf) {
+	case QRTR_PROTO_VER_1:
+		return qrtr_hdr_v1_decode(buf, len, f);
+	case QRTR_PROTO_VER_2:
+		return qrtr_hdr_v2_decode(buf, len, f);
+	}
+
+invalid:
+	errno = EPROTO;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "histogram.h"
+#include "util.h"
+
+/*
+ * Round trip latency benchmark.
+ *
+ * The emulated remote echoes every DATA packet back to its sender, while the
+ * local side sends one message at a time and timestamps each exchange. The
+ * wait for the reply is done either in a blocking recv(), in poll() or by
+ * busy polling with MSG_DONTWAIT.
+ *
+ * The payload size given with -s need not be a multiple of 4; the echo is sent
+ * with the unpadded size and qrtr_node_writev() pads it for qrtr-tun.
+ */
+
+#define REMOTE_NODE	100
+#define REMOTE_PORT	100
+
+#define MAX_PAYLOAD	8192
+
+enum {
+	WAIT_BLOCK,
+	WAIT_POLL,
+	WAIT_BUSY,
+};
+
+static const char * const wait_names[] = {
+	[WAIT_BLOCK] = "block",
+	[WAIT_POLL] = "poll",
+	[WAIT_BUSY] = "busy",
+};
+
+static void run_echo(struct qrtr_node *node, int ctl_fd)
+{
+	struct sockaddr_qrtr sq = { AF_QIPCRTR };
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd[2];
+	ssize_t n;
+	int ret;
+
+	pfd[0].fd = node->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctl_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		ret = poll(pfd, 2, -1);
+		if (ret < 0)
+			err(1, "[remote] poll failed");
+
+		if (pfd[1].revents)
+			break;
+
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
+			err(1, "[remote] failed to read");
+
+		hdr = pkt->hdr;
+		if (hdr->type != QRTR_TYPE_DATA) {
+			qrtr_pkt_put(pkt);
+			continue;
+		}
+
+		sq.sq_node = hdr->src_node_id;
+		sq.sq_port = hdr->src_port_id;
+
+		n = send_data(node, hdr->dst_port_id, &sq, pkt->data, pkt->len, 0);
+		if (n < 0)
+			err(1, "[remote] failed to echo");
+
+		if (hdr->confirm_rx)
+			qrtr_resume_tx(node, hdr->dst_node_id, hdr->dst_port_id, hdr->src_node_id, hdr->src_port_id);
+
+		qrtr_pkt_put(pkt);
+	}
+}
+
+static ssize_t wait_reply(int sock, void *buf, size_t len, int mode)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	int ret;
+
+	switch (mode) {
+	case WAIT_POLL:
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+
+		ret = poll(&pfd, 1, 5000);
+		if (ret < 0)
+			err(1, "poll failed");
+		if (!ret)
+			errx(1, "timeout waiting for echo");
+		/* fall through */
+	case WAIT_BLOCK:
+		return qrtr_recvfrom(sock, buf, len, 0, NULL);
+	case WAIT_BUSY:
+		do {
+			n = qrtr_recvfrom(sock, buf, len, MSG_DONTWAIT, NULL);
+		} while (n < 0 && errno == EAGAIN);
+
+		return n;
+	}
+
+	return -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-latency [-n count] [-w warmup] [-s size] [-m block|poll|busy]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_qrtr sq = { AF_QIPCRTR, REMOTE_NODE, REMOTE_PORT };
+	struct histogram hist;
+	struct qrtr_node *node;
+	char payload[MAX_PAYLOAD];
+	char buf[MAX_PAYLOAD];
+	unsigned warmup = 1000;
+	unsigned count = 100000;
+	size_t size = 4;
+	int mode = WAIT_BLOCK;
+	uint64_t start;
+	int tun_fd;
+	int ctl[2];
+	ssize_t n;
+	int sock;
+	int opt;
+	int pid;
+	int i;
+
+	while ((opt = getopt(argc, argv, "m:n:s:w:")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (mode = 0; mode < ARRAY_SIZE(wait_names); mode++)
+				if (!strcmp(optarg, wait_names[mode]))
+					break;
+			if (mode == ARRAY_SIZE(wait_names))
+				usage();
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			if (!size || size > MAX_PAYLOAD)
+				errx(1, "size must be in range [1, %d]", MAX_PAYLOAD);
+			break;
+		case 'w':
+			warmup = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	sock = qrtr_socket();
+	if (sock < 0)
+		err(1, "creating AF_QIPCRTR socket failed");
+
+	tun_fd = qrtr_tun_open();
+	if (tun_fd < 0)
+		err(1, "failed to open qrtr-tun");
+
+	node = qrtr_node_new(REMOTE_NODE, tun_fd);
+
+	n = qrtr_node_hello(node);
+	if (n < 0)
+		err(1, "failed to hello");
+
+	if (pipe(ctl) < 0)
+		err(1, "failed to create pipe");
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		err(1, "fork failed");
+	case 0:
+		qrtr_close(sock);
+		close(ctl[1]);
+		run_echo(node, ctl[0]);
+		exit(0);
+	}
+
+	close(tun_fd);
+	close(ctl[0]);
+
+	memset(payload, 0xa5, size);
+	hist_init(&hist);
+
+	for (i = 0; i < warmup + count; i++) {
+		start = time_ns();
+
+		n = qrtr_sendto(sock, payload, size, 0, &sq);
+		if (n < 0)
+			err(1, "failed to send to %d:%d", sq.sq_node, sq.sq_port);
+
+		n = wait_reply(sock, buf, sizeof(buf), mode);
+		if (n < 0)
+			err(1, "failed to receive echo");
+		if (n != size)
+			errx(1, "echo of %zd bytes, expected %zu", n, size);
+
+		if (i >= warmup)
+			hist_record(&hist, time_ns() - start);
+	}
+
+	close(ctl[1]);
+	wait(NULL);
+
+	printf("round trip latency, %zu byte payload, %s wait\n", size, wait_names[mode]);
+	hist_print(&hist, "ns");
+
+	hist_merge(metric_hist("round_trip", "ns"), &hist);
+
+	return 0;
+}
@@ -0,0 +1,387 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-loop.h"
+#include "qrtr-metrics.h"
+#include "histogram.h"
+#include "util.h"
+
+/*
+ * Name service lookup benchmark.
+ *
+ * A set of emulated remote nodes announce N services, spread as
+ * SERVICE_INSTANCES instances of each of N / SERVICE_INSTANCES service ids.
+ * A number of local client sockets then concurrently issue NEW_LOOKUP for
+ * random services, either filtered on the service id alone or on service id
+ * and instance, and the time until the listing is terminated by an empty
+ * NEW_SERVER is recorded. Each listing is checked against the expected number
+ * of matches before the lookup is removed again with DEL_LOOKUP.
+ */
+
+#define SERVICE_BASE		0x1000
+#define SERVICE_INSTANCES	16
+
+#define LOOKUP_TIMEOUT		5000
+
+enum {
+	FILTER_SERVICE,
+	FILTER_INSTANCE,
+};
+
+static const char * const filter_names[] = {
+	[FILTER_SERVICE] = "service",
+	[FILTER_INSTANCE] = "instance",
+};
+
+struct client {
+	int sock;
+	struct qrtr_timer timer;
+
+	unsigned int service;
+	unsigned int instance;
+
+	unsigned int replies;
+	unsigned int expected;
+	unsigned int remaining;
+
+	uint64_t start;
+};
+
+static unsigned service_count = 10000;
+static unsigned node_count = 16;
+static unsigned client_count = 16;
+static unsigned lookup_count = 1000;
+
+static struct sockaddr_qrtr ns_addr;
+static struct histogram hist;
+static unsigned active;
+static unsigned failed;
+static int filter;
+
+static void send_lookup(int sock, int cmd, unsigned int service, unsigned int instance)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+	ssize_t n;
+
+	pkt.cmd = cmd;
+	pkt.server.service = service;
+	pkt.server.instance = instance;
+
+	n = qrtr_sendto(sock, &pkt, sizeof(pkt), 0, &ns_addr);
+	if (n < 0)
+		err(1, "failed to send lookup request");
+}
+
+/* Number of services matching the filter of @client */
+static unsigned int lookup_matches(struct client *client)
+{
+	unsigned int first = (client->service - SERVICE_BASE) * SERVICE_INSTANCES;
+
+	if (client->instance)
+		return 1;
+
+	return MIN(SERVICE_INSTANCES, service_count - first);
+}
+
+static void client_start(struct qrtr_loop *loop, struct client *client)
+{
+	unsigned int idx = rand() % service_count;
+
+	client->service = SERVICE_BASE + idx / SERVICE_INSTANCES;
+	client->instance = filter == FILTER_INSTANCE ? idx % SERVICE_INSTANCES + 1 : 0;
+	client->expected = lookup_matches(client);
+	client->replies = 0;
+
+	qrtr_timer_arm(loop, &client->timer, LOOKUP_TIMEOUT);
+
+	client->start = time_ns();
+	send_lookup(client->sock, QRTR_TYPE_NEW_LOOKUP, client->service, client->instance);
+}
+
+static void client_done(struct qrtr_loop *loop, struct client *client)
+{
+	qrtr_timer_cancel(loop, &client->timer);
+
+	if (!--active)
+		qrtr_loop_quit(loop);
+}
+
+static void client_timeout(struct qrtr_loop *loop, struct qrtr_timer *timer)
+{
+	struct client *client = container_of(timer, struct client, timer);
+
+	warnx("lookup of %#x:%u timed out after %u of %u replies",
+	      client->service, client->instance, client->replies, client->expected);
+
+	/* Give up on the client, a late listing must not restart it */
+	client->remaining = 0;
+
+	failed++;
+	client_done(loop, client);
+}
+
+static void client_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	struct client *client = data;
+	struct qrtr_ctrl_pkt pkt;
+	ssize_t n;
+
+	for (;;) {
+		n = qrtr_recvfrom(fd, &pkt, sizeof(pkt), MSG_DONTWAIT, NULL);
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n < 0)
+			err(1, "failed to receive lookup reply");
+
+		if (n < sizeof(pkt) || pkt.cmd != QRTR_TYPE_NEW_SERVER)
+			continue;
+
+		/* Done, or timed out, ignore what's left of the listing */
+		if (!client->remaining)
+			continue;
+
+		if (pkt.server.service || pkt.server.instance ||
+		    pkt.server.node || pkt.server.port) {
+			if (pkt.server.service != client->service ||
+			    (client->instance && pkt.server.instance != client->instance))
+				warnx("lookup of %#x:%u returned %#x:%u", client->service,
+				      client->instance, pkt.server.service, pkt.server.instance);
+
+			client->replies++;
+			continue;
+		}
+
+		/* The empty NEW_SERVER terminates the listing */
+		hist_record(&hist, time_ns() - client->start);
+
+		if (client->replies != client->expected) {
+			warnx("lookup of %#x:%u returned %u services, expected %u",
+			      client->service, client->instance, client->replies,
+			      client->expected);
+			failed++;
+		}
+
+		send_lookup(fd, QRTR_TYPE_DEL_LOOKUP, client->service, client->instance);
+
+		if (--client->remaining)
+			client_start(loop, client);
+		else
+			client_done(loop, client);
+
+		/*
+		 * The next listing is likely already queued, yield to the other
+		 * clients rather than running through all lookups in one go.
+		 */
+		return;
+	}
+}
+
+/* Wait for the name service to have consumed the last announcement */
+static void wait_services(int sock)
+{
+	unsigned int idx = service_count - 1;
+	unsigned int service = SERVICE_BASE + idx / SERVICE_INSTANCES;
+	unsigned int instance = idx % SERVICE_INSTANCES + 1;
+	struct qrtr_ctrl_pkt pkt;
+	struct pollfd pfd;
+	bool found = false;
+	uint64_t deadline;
+	ssize_t n;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	deadline = time_ns() + LOOKUP_TIMEOUT * 1000000ull;
+	while (!found) {
+		if (time_ns() > deadline)
+			errx(1, "services never showed up in the name service");
+
+		send_lookup(sock, QRTR_TYPE_NEW_LOOKUP, service, instance);
+
+		for (;;) {
+			n = poll(&pfd, 1, LOOKUP_TIMEOUT);
+			if (n < 0)
+				err(1, "poll failed");
+			if (!n)
+				errx(1, "timeout waiting for lookup reply");
+
+			n = qrtr_recvfrom(sock, &pkt, sizeof(pkt), 0, NULL);
+			if (n < 0)
+				err(1, "failed to receive lookup reply");
+
+			if (n < sizeof(pkt) || pkt.cmd != QRTR_TYPE_NEW_SERVER)
+				continue;
+
+			if (!pkt.server.service && !pkt.server.instance &&
+			    !pkt.server.node && !pkt.server.port)
+				break;
+
+			found = true;
+		}
+
+		send_lookup(sock, QRTR_TYPE_DEL_LOOKUP, service, instance);
+
+		if (!found)
+			usleep(1000);
+	}
+}
+
+static void run_lookups(struct qrtr_loop *loop, struct client *clients)
+{
+	uint64_t start;
+	uint64_t elapsed;
+	int i;
+
+	hist_init(&hist);
+	failed = 0;
+	active = client_count;
+
+	start = time_ns();
+
+	for (i = 0; i < client_count; i++) {
+		clients[i].remaining = lookup_count;
+		client_start(loop, &clients[i]);
+	}
+
+	if (qrtr_loop_run(loop) < 0)
+		err(1, "event loop failed");
+
+	elapsed = time_ns() - start;
+
+	printf("lookup latency, %u services on %u nodes, %u clients, %s filter\n",
+	       service_count, node_count, client_count, filter_names[filter]);
+	printf("%.0f lookups/s\n", hist.count * 1e9 / elapsed);
+	hist_print(&hist, "ns");
+
+	hist_merge(metric_hist("lookup", "ns"), &hist);
+	metric_gauge("lookups_per_s", hist.count * 1e9 / elapsed);
+	metric_count("failed", failed);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-lookup [-n services] [-r nodes] [-c clients] [-i lookups] [-f service|instance]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct qrtr_node **nodes;
+	struct client *clients;
+	struct qrtr_loop *loop;
+	int filter_arg = -1;
+	unsigned int idx;
+	int tun_fd;
+	int opt;
+	int ret;
+	int i;
+
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "c:f:i:n:r:")) != -1) {
+		switch (opt) {
+		case 'c':
+			client_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			for (filter_arg = 0; filter_arg < ARRAY_SIZE(filter_names); filter_arg++)
+				if (!strcmp(optarg, filter_names[filter_arg]))
+					break;
+			if (filter_arg == ARRAY_SIZE(filter_names))
+				usage();
+			break;
+		case 'i':
+			lookup_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			service_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			node_count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!service_count || !node_count || !client_count || !lookup_count)
+		usage();
+
+	tun_fd = qrtr_tun_open();
+	if (tun_fd < 0)
+		err(1, "failed to open qrtr-tun");
+
+	nodes = calloc(node_count, sizeof(*nodes));
+	clients = calloc(client_count, sizeof(*clients));
+	if (!nodes || !clients)
+		err(1, "failed to allocate nodes");
+
+	for (i = 0; i < node_count; i++) {
+		nodes[i] = qrtr_node_new(qrtr_test_node(i), tun_fd);
+
+		ret = qrtr_node_hello(nodes[i]);
+		if (ret < 0)
+			err(1, "failed to hello node %d", nodes[i]->node_id);
+	}
+
+	/* Service i lives on port 1 + i / nodes of node i % nodes */
+	for (idx = 0; idx < service_count; idx++) {
+		ret = qrtr_node_new_server(nodes[idx % node_count],
+					   SERVICE_BASE + idx / SERVICE_INSTANCES,
+					   idx % SERVICE_INSTANCES + 1,
+					   1 + idx / node_count);
+		if (ret < 0)
+			err(1, "failed to announce service %u", idx);
+	}
+
+	loop = qrtr_loop_new();
+	if (!loop)
+		err(1, "failed to create event loop");
+
+	for (i = 0; i < client_count; i++) {
+		clients[i].sock = qrtr_socket();
+		if (clients[i].sock < 0)
+			err(1, "creating AF_QIPCRTR socket failed");
+
+		qrtr_timer_init(&clients[i].timer, client_timeout);
+
+		ret = qrtr_loop_add_fd(loop, clients[i].sock, EPOLLIN, client_event, &clients[i]);
+		if (ret < 0)
+			err(1, "failed to watch socket");
+	}
+
+	ret = qrtr_getsockname(clients[0].sock, &ns_addr);
+	if (ret < 0)
+		err(1, "getsockname failed");
+
+	ns_addr.sq_port = QRTR_PORT_CTRL;
+
+	wait_services(clients[0].sock);
+
+	for (filter = 0; filter < ARRAY_SIZE(filter_names); filter++) {
+		if (filter_arg >= 0 && filter != filter_arg)
+			continue;
+
+		run_lookups(loop, clients);
+		if (failed)
+			errx(1, "%u lookups failed", failed);
+	}
+
+	close(tun_fd);
+
+	return 0;
+}
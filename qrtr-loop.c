@@ -0,0 +1,295 @@
+#include <sys/epoll.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr-loop.h"
+#include "util.h"
+
+/*
+ * Single threaded event loop, dispatching epoll events for any number of file
+ * descriptors and running timers off a hierarchical timing wheel.
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots with a 1ms tick. A
+ * timer is kept in the lowest level where its expiry shares all more
+ * significant digits with the current time, and is moved one level down
+ * (cascaded) when the current time reaches its slot, so arming, cancelling
+ * and expiring a timer are all O(1).
+ */
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+
+#define MAX_EVENTS	64
+
+struct fd_watch {
+	qrtr_loop_fd_cb cb;
+	void *data;
+};
+
+struct qrtr_loop {
+	int epoll_fd;
+	bool quit;
+
+	struct fd_watch *watches;
+	unsigned int nwatches;
+	unsigned int nfds;
+
+	uint64_t now;
+	unsigned int ntimers;
+	struct qrtr_timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static uint64_t now_ms(void)
+{
+	return time_ns() / 1000000;
+}
+
+struct qrtr_loop *qrtr_loop_new(void)
+{
+	struct qrtr_loop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop)
+		return NULL;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		free(loop);
+		return NULL;
+	}
+
+	loop->now = now_ms();
+
+	return loop;
+}
+
+void qrtr_loop_free(struct qrtr_loop *loop)
+{
+	close(loop->epoll_fd);
+	free(loop->watches);
+	free(loop);
+}
+
+int qrtr_loop_add_fd(struct qrtr_loop *loop, int fd, uint32_t events, qrtr_loop_fd_cb cb, void *data)
+{
+	struct epoll_event ev = {};
+	struct fd_watch *watches;
+	unsigned int n;
+
+	if (fd >= loop->nwatches) {
+		n = MAX(fd + 1, 2 * loop->nwatches);
+
+		watches = realloc(loop->watches, n * sizeof(*watches));
+		if (!watches)
+			return -1;
+
+		memset(watches + loop->nwatches, 0, (n - loop->nwatches) * sizeof(*watches));
+		loop->watches = watches;
+		loop->nwatches = n;
+	}
+
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	loop->watches[fd].cb = cb;
+	loop->watches[fd].data = data;
+	loop->nfds++;
+
+	return 0;
+}
+
+int qrtr_loop_mod_fd(struct qrtr_loop *loop, int fd, uint32_t events)
+{
+	struct epoll_event ev = {};
+
+	ev.events = events;
+	ev.data.fd = fd;
+
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int qrtr_loop_del_fd(struct qrtr_loop *loop, int fd)
+{
+	if (fd >= loop->nwatches || !loop->watches[fd].cb) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	loop->watches[fd].cb = NULL;
+	loop->nfds--;
+
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void qrtr_timer_init(struct qrtr_timer *timer, void (*cb)(struct qrtr_loop *, struct qrtr_timer *))
+{
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->cb = cb;
+}
+
+static void wheel_insert(struct qrtr_loop *loop, struct qrtr_timer *timer)
+{
+	struct qrtr_timer **slot;
+	unsigned int shift;
+	int level;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		shift = WHEEL_BITS * (level + 1);
+		if ((timer->expires >> shift) == (loop->now >> shift))
+			break;
+	}
+
+	slot = &loop->wheel[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void wheel_unlink(struct qrtr_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+void qrtr_timer_arm(struct qrtr_loop *loop, struct qrtr_timer *timer, unsigned int timeout_ms)
+{
+	if (timer->pprev)
+		wheel_unlink(timer);
+	else
+		loop->ntimers++;
+
+	timer->expires = loop->now + MAX(timeout_ms, 1);
+
+	wheel_insert(loop, timer);
+}
+
+void qrtr_timer_cancel(struct qrtr_loop *loop, struct qrtr_timer *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	wheel_unlink(timer);
+	loop->ntimers--;
+}
+
+static void cascade(struct qrtr_loop *loop, int level)
+{
+	struct qrtr_timer *timer;
+	struct qrtr_timer *list;
+	unsigned int idx;
+
+	idx = (loop->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	list = loop->wheel[level][idx];
+	loop->wheel[level][idx] = NULL;
+
+	while (list) {
+		timer = list;
+		list = timer->next;
+
+		wheel_insert(loop, timer);
+	}
+}
+
+static void advance(struct qrtr_loop *loop, uint64_t target)
+{
+	struct qrtr_timer **slot;
+	struct qrtr_timer *timer;
+	int level;
+
+	while (loop->now < target && !loop->quit) {
+		if (!loop->ntimers) {
+			loop->now = target;
+			break;
+		}
+
+		loop->now++;
+
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if (loop->now & ((1ull << (WHEEL_BITS * level)) - 1))
+				break;
+		}
+
+		while (--level > 0)
+			cascade(loop, level);
+
+		slot = &loop->wheel[0][loop->now & WHEEL_MASK];
+		while ((timer = *slot) != NULL) {
+			wheel_unlink(timer);
+			loop->ntimers--;
+
+			timer->cb(loop, timer);
+		}
+	}
+}
+
+/* Milliseconds until the wheel needs to be advanced again, or -1 */
+static int next_timeout(struct qrtr_loop *loop)
+{
+	uint64_t now = now_ms();
+	unsigned int i;
+	int delta;
+
+	if (!loop->ntimers)
+		return -1;
+
+	for (i = 1; i < WHEEL_SIZE - (loop->now & WHEEL_MASK); i++) {
+		if (loop->wheel[0][(loop->now + i) & WHEEL_MASK])
+			break;
+	}
+
+	delta = (int)(loop->now + i - now);
+
+	return MAX(delta, 0);
+}
+
+int qrtr_loop_run(struct qrtr_loop *loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct fd_watch *watch;
+	int fd;
+	int n;
+	int i;
+
+	loop->quit = false;
+
+	while (!loop->quit && (loop->nfds || loop->ntimers)) {
+		n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, next_timeout(loop));
+		if (n < 0 && errno != EINTR)
+			return -1;
+
+		advance(loop, now_ms());
+
+		for (i = 0; i < n && !loop->quit; i++) {
+			fd = events[i].data.fd;
+
+			/* The watch may have been removed by an earlier callback */
+			watch = &loop->watches[fd];
+			if (watch->cb)
+				watch->cb(loop, fd, events[i].events, watch->data);
+		}
+	}
+
+	return 0;
+}
+
+void qrtr_loop_quit(struct qrtr_loop *loop)
+{
+	loop->quit = true;
+}
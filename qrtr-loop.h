@@ -0,0 +1,33 @@
+#ifndef __QRTR_LOOP_H__
+#define __QRTR_LOOP_H__
+
+#include <stdint.h>
+
+struct qrtr_loop;
+
+struct qrtr_timer {
+	struct qrtr_timer *next;
+	struct qrtr_timer **pprev;
+
+	uint64_t expires;
+
+	void (*cb)(struct qrtr_loop *loop, struct qrtr_timer *timer);
+};
+
+typedef void (*qrtr_loop_fd_cb)(struct qrtr_loop *loop, int fd, uint32_t events, void *data);
+
+struct qrtr_loop *qrtr_loop_new(void);
+void qrtr_loop_free(struct qrtr_loop *loop);
+
+int qrtr_loop_add_fd(struct qrtr_loop *loop, int fd, uint32_t events, qrtr_loop_fd_cb cb, void *data);
+int qrtr_loop_mod_fd(struct qrtr_loop *loop, int fd, uint32_t events);
+int qrtr_loop_del_fd(struct qrtr_loop *loop, int fd);
+
+void qrtr_timer_init(struct qrtr_timer *timer, void (*cb)(struct qrtr_loop *, struct qrtr_timer *));
+void qrtr_timer_arm(struct qrtr_loop *loop, struct qrtr_timer *timer, unsigned int timeout_ms);
+void qrtr_timer_cancel(struct qrtr_loop *loop, struct qrtr_timer *timer);
+
+int qrtr_loop_run(struct qrtr_loop *loop);
+void qrtr_loop_quit(struct qrtr_loop *loop);
+
+#endif
@@ -0,0 +1,1267 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-loop.h"
+#include "qrtr-loopback.h"
+#include "util.h"
+
+/*
+ * Userspace stand-in for the kernel QRTR router and name service.
+ *
+ * The router runs in a helper process, forked on first use, listening on an
+ * abstract AF_UNIX SOCK_SEQPACKET address that is passed on to child
+ * processes through the QRTR_LOOPBACK environment variable. It lives for as
+ * long as the process that started it, or any of its children, does.
+ *
+ * A "tun" connection carries raw QRTR packets, exactly like /dev/qrtr-tun:
+ * payloads are padded to 4 bytes and packets that aren't are dropped.
+ * A local socket is represented by two connections: a data channel, from
+ * which received messages are read and which is polled by the tests, and a
+ * control channel for synchronous requests such as bind and send. Messages on
+ * both are prefixed with a struct qrtr_lo_hdr.
+ *
+ * The router mimics the kernel closely enough for the tests: nodes are
+ * assigned to the endpoint they are first heard from, HELLO is answered and
+ * followed by announcements of the local services, DATA towards a remote is
+ * flow controlled per destination using confirm_rx and RESUME_TX with the
+ * same watermarks as the kernel, local NEW_SERVER and DEL_SERVER are
+ * broadcast to all endpoints and lookups are served from the combined
+ * service table.
+ */
+
+#define FLOW_HIGH	10
+#define FLOW_LOW	5
+
+#define HASH_SIZE	4096
+
+/* Messages queued to a local socket before new ones are dropped */
+#define SOCK_QUEUE_MAX	1024
+
+/* Fits a padded maximum size payload behind any header */
+#define RX_BUF_SIZE	(QRTR_HDR_MAX_LEN + ((QRTR_MAX_PAYLOAD + 3) & ~3))
+
+enum {
+	CONN_NEW,
+	CONN_TUN,
+	CONN_SOCK,
+	CONN_CTL,
+};
+
+struct lo_buf {
+	struct lo_buf *next;
+	size_t len;
+	char data[];
+};
+
+struct lo_conn {
+	int fd;
+	int kind;
+
+	struct lo_sock *sock;
+	struct lo_node *nodes;
+
+	struct lo_buf *head;
+	struct lo_buf *tail;
+	unsigned int queued;
+};
+
+struct lo_node {
+	uint32_t id;
+	struct lo_conn *ep;
+
+	struct lo_node *hash_next;
+	struct lo_node *ep_next;
+
+	struct lo_service *services;
+};
+
+struct lo_sock {
+	uint32_t port;
+
+	struct lo_conn *data;
+	struct lo_conn *ctl;
+
+	struct lo_sock *hash_next;
+
+	struct lo_service *services;
+};
+
+struct lo_service {
+	uint32_t service;
+	uint32_t instance;
+	uint32_t node;
+	uint32_t port;
+
+	struct lo_service *prev;
+	struct lo_service *next;
+	struct lo_service *owner_next;
+};
+
+struct lo_lookup {
+	struct lo_sock *sock;
+	uint32_t service;
+	uint32_t instance;
+
+	struct lo_lookup *next;
+};
+
+struct lo_waiter {
+	struct lo_waiter *next;
+	struct lo_sock *sock;
+	size_t len;
+	char data[];
+};
+
+struct lo_flow {
+	uint32_t node;
+	uint32_t port;
+	unsigned int pending;
+
+	struct lo_waiter *waiters;
+	struct lo_waiter **waiters_tail;
+
+	struct lo_flow *hash_next;
+};
+
+static struct qrtr_loop *lo_loop;
+static struct lo_conn **lo_conns;
+static unsigned int lo_nconns;
+
+static struct lo_node *lo_nodes[HASH_SIZE];
+static struct lo_sock *lo_socks[HASH_SIZE];
+static struct lo_flow *lo_flows[HASH_SIZE];
+static struct lo_service *lo_services;
+static struct lo_lookup *lo_lookups;
+
+static uint32_t lo_next_port = 0x4000;
+
+static unsigned int hash32(uint32_t v)
+{
+	return (v * 0x9e3779b1u) >> 20;
+}
+
+static unsigned int hash_flow(uint32_t node, uint32_t port)
+{
+	return hash32(node * 31 + port);
+}
+
+static struct lo_node *node_lookup(uint32_t id)
+{
+	struct lo_node *node;
+
+	for (node = lo_nodes[hash32(id)]; node; node = node->hash_next) {
+		if (node->id == id)
+			return node;
+	}
+
+	return NULL;
+}
+
+static struct lo_sock *sock_lookup(uint32_t port)
+{
+	struct lo_sock *sock;
+
+	for (sock = lo_socks[hash32(port)]; sock; sock = sock->hash_next) {
+		if (sock->port == port)
+			return sock;
+	}
+
+	return NULL;
+}
+
+static void sock_hash_del(struct lo_sock *sock)
+{
+	struct lo_sock **pp;
+
+	for (pp = &lo_socks[hash32(sock->port)]; *pp; pp = &(*pp)->hash_next) {
+		if (*pp == sock) {
+			*pp = sock->hash_next;
+			break;
+		}
+	}
+}
+
+static void sock_hash_add(struct lo_sock *sock)
+{
+	unsigned int h = hash32(sock->port);
+
+	sock->hash_next = lo_socks[h];
+	lo_socks[h] = sock;
+}
+
+/*
+ * Output, queueing whatever the peer isn't ready to accept. pad zero bytes
+ * follow the data, for tun packets.
+ */
+static void conn_send(struct lo_conn *conn, const void *hdr, size_t hdr_len,
+		      const void *data, size_t len, size_t pad)
+{
+	static const char zeros[4];
+	struct lo_buf *buf;
+	struct msghdr msg = {};
+	struct iovec iov[3];
+	ssize_t n;
+
+	if (!conn->head) {
+		iov[0].iov_base = (void *)hdr;
+		iov[0].iov_len = hdr_len;
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = len;
+		iov[2].iov_base = (void *)zeros;
+		iov[2].iov_len = pad;
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = pad ? 3 : 2;
+
+		n = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return;
+	}
+
+	/* A local socket drops messages when its receive queue is full */
+	if (conn->kind == CONN_SOCK && conn->queued >= SOCK_QUEUE_MAX)
+		return;
+
+	buf = malloc(sizeof(*buf) + hdr_len + len + pad);
+	if (!buf)
+		return;
+
+	buf->next = NULL;
+	buf->len = hdr_len + len + pad;
+	memcpy(buf->data, hdr, hdr_len);
+	memcpy(buf->data + hdr_len, data, len);
+	memset(buf->data + hdr_len + len, 0, pad);
+
+	if (conn->tail)
+		conn->tail->next = buf;
+	else
+		conn->head = buf;
+	conn->tail = buf;
+
+	if (!conn->queued++)
+		qrtr_loop_mod_fd(lo_loop, conn->fd, EPOLLIN | EPOLLOUT);
+}
+
+static void conn_flush(struct lo_conn *conn)
+{
+	struct lo_buf *buf;
+	ssize_t n;
+
+	while ((buf = conn->head) != NULL) {
+		n = send(conn->fd, buf->data, buf->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		conn->head = buf->next;
+		if (!conn->head)
+			conn->tail = NULL;
+		conn->queued--;
+		free(buf);
+	}
+
+	qrtr_loop_mod_fd(lo_loop, conn->fd, EPOLLIN);
+}
+
+static void reply(struct lo_conn *conn, uint32_t node, uint32_t port, int arg)
+{
+	struct qrtr_lo_hdr hdr = { QRTR_LO_REPLY, node, port, arg };
+
+	conn_send(conn, &hdr, sizeof(hdr), NULL, 0, 0);
+}
+
+static void ep_send(struct lo_conn *ep, int type, uint32_t src_node, uint32_t src_port,
+		    uint32_t dst_node, uint32_t dst_port, int confirm_rx,
+		    const void *data, size_t len)
+{
+	struct qrtr_hdr_fields f = {};
+	struct qrtr_hdr_v1 hdr;
+
+	f.type = type;
+	f.src_node_id = src_node;
+	f.src_port_id = src_port;
+	f.confirm_rx = confirm_rx;
+	f.size = len;
+	f.dst_node_id = dst_node;
+	f.dst_port_id = dst_port;
+
+	/* The kernel always transmits v1 headers */
+	qrtr_hdr_v1_encode(&hdr, &f);
+
+	/* Like the kernel, pad the payload to 4 bytes */
+	conn_send(ep, &hdr, sizeof(hdr), data, len, -len & 3);
+}
+
+static void ep_bcast(int type, const void *data, size_t len)
+{
+	struct lo_conn *conn;
+	int i;
+
+	for (i = 0; i < lo_nconns; i++) {
+		conn = lo_conns[i];
+		if (conn && conn->kind == CONN_TUN && conn->nodes)
+			ep_send(conn, type, QRTR_LOOPBACK_NODE, QRTR_PORT_CTRL,
+				QRTR_NODE_BCAST, QRTR_PORT_CTRL, 0, data, len);
+	}
+}
+
+static void sock_deliver(struct lo_sock *sock, uint32_t src_node, uint32_t src_port,
+			 int confirm_rx, const void *data, size_t len)
+{
+	struct qrtr_lo_hdr hdr = { QRTR_LO_DATA, src_node, src_port, confirm_rx };
+
+	conn_send(sock->data, &hdr, sizeof(hdr), data, len, 0);
+}
+
+/* Name service */
+
+static bool lookup_match(struct lo_lookup *lookup, struct lo_service *srv)
+{
+	if (lookup->service != srv->service)
+		return false;
+
+	return !lookup->instance || lookup->instance == srv->instance;
+}
+
+static void lookup_notify(struct lo_sock *sock, struct lo_service *srv, int cmd)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+
+	pkt.cmd = cmd;
+	if (srv) {
+		pkt.server.service = srv->service;
+		pkt.server.instance = srv->instance;
+		pkt.server.node = srv->node;
+		pkt.server.port = srv->port;
+	}
+
+	sock_deliver(sock, QRTR_LOOPBACK_NODE, QRTR_PORT_CTRL, 0, &pkt, sizeof(pkt));
+}
+
+static void service_notify(struct lo_service *srv, int cmd)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+	struct lo_lookup *lookup;
+
+	if (srv->node == QRTR_LOOPBACK_NODE) {
+		pkt.cmd = cmd;
+		pkt.server.service = srv->service;
+		pkt.server.instance = srv->instance;
+		pkt.server.node = srv->node;
+		pkt.server.port = srv->port;
+
+		ep_bcast(cmd, &pkt, sizeof(pkt));
+	}
+
+	for (lookup = lo_lookups; lookup; lookup = lookup->next) {
+		if (lookup_match(lookup, srv))
+			lookup_notify(lookup->sock, srv, cmd);
+	}
+}
+
+static void service_add(struct lo_service **owner, uint32_t service, uint32_t instance,
+			uint32_t node, uint32_t port)
+{
+	struct lo_service *srv;
+
+	srv = calloc(1, sizeof(*srv));
+	if (!srv)
+		return;
+
+	srv->service = service;
+	srv->instance = instance;
+	srv->node = node;
+	srv->port = port;
+
+	srv->next = lo_services;
+	if (lo_services)
+		lo_services->prev = srv;
+	lo_services = srv;
+
+	srv->owner_next = *owner;
+	*owner = srv;
+
+	service_notify(srv, QRTR_TYPE_NEW_SERVER);
+}
+
+static void service_unlink(struct lo_service *srv)
+{
+	if (srv->prev)
+		srv->prev->next = srv->next;
+	else
+		lo_services = srv->next;
+	if (srv->next)
+		srv->next->prev = srv->prev;
+
+	service_notify(srv, QRTR_TYPE_DEL_SERVER);
+}
+
+static void service_del(struct lo_service **owner, uint32_t service, uint32_t instance,
+			uint32_t node, uint32_t port)
+{
+	struct lo_service **pp;
+	struct lo_service *srv;
+
+	for (pp = owner; (srv = *pp) != NULL; pp = &srv->owner_next) {
+		if (srv->service == service && srv->instance == instance &&
+		    srv->node == node && srv->port == port) {
+			*pp = srv->owner_next;
+			service_unlink(srv);
+			free(srv);
+			return;
+		}
+	}
+}
+
+static void service_del_all(struct lo_service **owner)
+{
+	struct lo_service *srv;
+
+	while ((srv = *owner) != NULL) {
+		*owner = srv->owner_next;
+		service_unlink(srv);
+		free(srv);
+	}
+}
+
+static void lookup_add(struct lo_sock *sock, uint32_t service, uint32_t instance)
+{
+	struct lo_lookup *lookup;
+	struct lo_service *srv;
+
+	lookup = calloc(1, sizeof(*lookup));
+	if (!lookup)
+		return;
+
+	lookup->sock = sock;
+	lookup->service = service;
+	lookup->instance = instance;
+	lookup->next = lo_lookups;
+	lo_lookups = lookup;
+
+	for (srv = lo_services; srv; srv = srv->next) {
+		if (lookup_match(lookup, srv))
+			lookup_notify(sock, srv, QRTR_TYPE_NEW_SERVER);
+	}
+
+	/* An empty NEW_SERVER terminates the initial listing */
+	lookup_notify(sock, NULL, QRTR_TYPE_NEW_SERVER);
+}
+
+static void lookup_del(struct lo_sock *sock, bool all, uint32_t service, uint32_t instance)
+{
+	struct lo_lookup **pp;
+	struct lo_lookup *lookup;
+
+	pp = &lo_lookups;
+	while ((lookup = *pp) != NULL) {
+		if (lookup->sock == sock &&
+		    (all || (lookup->service == service && lookup->instance == instance))) {
+			*pp = lookup->next;
+			free(lookup);
+		} else {
+			pp = &lookup->next;
+		}
+	}
+}
+
+/* Remote lookups are answered, but not tracked for later changes */
+static void remote_lookup(struct lo_conn *ep, uint32_t node, uint32_t port,
+			  uint32_t service, uint32_t instance)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+	struct lo_service *srv;
+
+	for (srv = lo_services; srv; srv = srv->next) {
+		if (srv->service != service || (instance && srv->instance != instance))
+			continue;
+
+		pkt.cmd = QRTR_TYPE_NEW_SERVER;
+		pkt.server.service = srv->service;
+		pkt.server.instance = srv->instance;
+		pkt.server.node = srv->node;
+		pkt.server.port = srv->port;
+
+		ep_send(ep, QRTR_TYPE_NEW_SERVER, QRTR_LOOPBACK_NODE, QRTR_PORT_CTRL,
+			node, port, 0, &pkt, sizeof(pkt));
+	}
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.cmd = QRTR_TYPE_NEW_SERVER;
+	ep_send(ep, QRTR_TYPE_NEW_SERVER, QRTR_LOOPBACK_NODE, QRTR_PORT_CTRL,
+		node, port, 0, &pkt, sizeof(pkt));
+}
+
+/* Flow control towards remote destinations */
+
+static struct lo_flow *flow_get(uint32_t node, uint32_t port)
+{
+	struct lo_flow *flow;
+	unsigned int h = hash_flow(node, port);
+
+	for (flow = lo_flows[h]; flow; flow = flow->hash_next) {
+		if (flow->node == node && flow->port == port)
+			return flow;
+	}
+
+	flow = calloc(1, sizeof(*flow));
+	if (!flow)
+		return NULL;
+
+	flow->node = node;
+	flow->port = port;
+	flow->waiters_tail = &flow->waiters;
+	flow->hash_next = lo_flows[h];
+	lo_flows[h] = flow;
+
+	return flow;
+}
+
+static void flow_send(struct lo_flow *flow, struct lo_node *node, struct lo_sock *sock,
+		      const void *data, size_t len)
+{
+	flow->pending++;
+
+	ep_send(node->ep, QRTR_TYPE_DATA, QRTR_LOOPBACK_NODE, sock->port,
+		flow->node, flow->port, flow->pending == FLOW_LOW, data, len);
+}
+
+static void flow_resume(uint32_t node_id, uint32_t port)
+{
+	struct lo_waiter *waiter;
+	struct lo_flow *flow;
+	struct lo_node *node;
+
+	node = node_lookup(node_id);
+	flow = flow_get(node_id, port);
+	if (!node || !flow)
+		return;
+
+	flow->pending = 0;
+
+	while (flow->waiters && flow->pending < FLOW_HIGH) {
+		waiter = flow->waiters;
+		flow->waiters = waiter->next;
+		if (!flow->waiters)
+			flow->waiters_tail = &flow->waiters;
+
+		flow_send(flow, node, waiter->sock, waiter->data, waiter->len);
+		reply(waiter->sock->ctl, 0, 0, waiter->len);
+		free(waiter);
+	}
+}
+
+/*
+ * Drop flows matching the given node, or waiters belonging to the given
+ * socket, failing any blocked senders with EPIPE.
+ */
+static void flows_release(struct lo_node *node, struct lo_sock *sock)
+{
+	struct lo_waiter **wp;
+	struct lo_waiter *waiter;
+	struct lo_flow **pp;
+	struct lo_flow *flow;
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		pp = &lo_flows[i];
+		while ((flow = *pp) != NULL) {
+			wp = &flow->waiters;
+			while ((waiter = *wp) != NULL) {
+				if ((node && flow->node == node->id) || waiter->sock == sock) {
+					*wp = waiter->next;
+					if (node)
+						reply(waiter->sock->ctl, 0, 0, -EPIPE);
+					free(waiter);
+				} else {
+					wp = &waiter->next;
+				}
+			}
+			flow->waiters_tail = wp;
+
+			if (node && flow->node == node->id) {
+				*pp = flow->hash_next;
+				free(flow);
+			} else {
+				pp = &flow->hash_next;
+			}
+		}
+	}
+}
+
+/* Endpoints and nodes */
+
+static struct lo_node *node_assign(struct lo_conn *ep, uint32_t id)
+{
+	struct lo_node **pp;
+	struct lo_node *node;
+	unsigned int h = hash32(id);
+
+	/*
+	 * Like the kernel, let the latest endpoint claim the node id; the old
+	 * endpoint may not have been torn down yet.
+	 */
+	node = node_lookup(id);
+	if (node && node->ep != ep) {
+		for (pp = &node->ep->nodes; *pp; pp = &(*pp)->ep_next) {
+			if (*pp == node) {
+				*pp = node->ep_next;
+				break;
+			}
+		}
+
+		node->ep = ep;
+		node->ep_next = ep->nodes;
+		ep->nodes = node;
+	}
+
+	if (node)
+		return node;
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	node->id = id;
+	node->ep = ep;
+	node->hash_next = lo_nodes[h];
+	lo_nodes[h] = node;
+	node->ep_next = ep->nodes;
+	ep->nodes = node;
+
+	return node;
+}
+
+static void node_release(struct lo_node *node)
+{
+	struct lo_node **pp;
+
+	for (pp = &lo_nodes[hash32(node->id)]; *pp; pp = &(*pp)->hash_next) {
+		if (*pp == node) {
+			*pp = node->hash_next;
+			break;
+		}
+	}
+
+	for (pp = &node->ep->nodes; *pp; pp = &(*pp)->ep_next) {
+		if (*pp == node) {
+			*pp = node->ep_next;
+			break;
+		}
+	}
+
+	service_del_all(&node->services);
+	flows_release(node, NULL);
+	free(node);
+}
+
+static void tun_ctrl(struct lo_conn *ep, struct lo_node *node, const struct qrtr_hdr_fields *hdr,
+		     struct qrtr_ctrl_pkt *pkt)
+{
+	struct lo_service *srv;
+
+	switch (hdr->type) {
+	case QRTR_TYPE_HELLO:
+		ep_send(ep, QRTR_TYPE_HELLO, QRTR_LOOPBACK_NODE, QRTR_PORT_CTRL,
+			node->id, QRTR_PORT_CTRL, 0, pkt, sizeof(*pkt));
+
+		for (srv = lo_services; srv; srv = srv->next) {
+			struct qrtr_ctrl_pkt ann = {};
+
+			if (srv->node != QRTR_LOOPBACK_NODE)
+				continue;
+
+			ann.cmd = QRTR_TYPE_NEW_SERVER;
+			ann.server.service = srv->service;
+			ann.server.instance = srv->instance;
+			ann.server.node = srv->node;
+			ann.server.port = srv->port;
+
+			ep_send(ep, QRTR_TYPE_NEW_SERVER, QRTR_LOOPBACK_NODE, QRTR_PORT_CTRL,
+				node->id, QRTR_PORT_CTRL, 0, &ann, sizeof(ann));
+		}
+		break;
+	case QRTR_TYPE_BYE:
+		node_release(node);
+		break;
+	case QRTR_TYPE_NEW_SERVER:
+		service_add(&node->services, pkt->server.service, pkt->server.instance,
+			    pkt->server.node, pkt->server.port);
+		break;
+	case QRTR_TYPE_DEL_SERVER:
+		service_del(&node->services, pkt->server.service, pkt->server.instance,
+			    pkt->server.node, pkt->server.port);
+		break;
+	case QRTR_TYPE_RESUME_TX:
+		flow_resume(pkt->client.node, pkt->client.port);
+		break;
+	case QRTR_TYPE_NEW_LOOKUP:
+		remote_lookup(ep, hdr->src_node_id, hdr->src_port_id,
+			      pkt->server.service, pkt->server.instance);
+		break;
+	}
+}
+
+/* Like the kernel, remotes may send either header version */
+static void tun_rx(struct lo_conn *ep, void *buf, size_t len)
+{
+	struct qrtr_hdr_fields hdr;
+	struct qrtr_ctrl_pkt pkt = {};
+	struct lo_node *node;
+	struct lo_sock *sock;
+	ssize_t hdr_len;
+	void *data;
+
+	hdr_len = qrtr_hdr_decode(buf, len, &hdr);
+	if (hdr_len < 0)
+		return;
+
+	/* qrtr_endpoint_post() drops packets not padded to 4 bytes */
+	if (len != hdr_len + ((hdr.size + 3) & ~(size_t)3))
+		return;
+
+	data = (char *)buf + hdr_len;
+	len = hdr.size;
+
+	node = node_assign(ep, hdr.src_node_id);
+	if (!node)
+		return;
+
+	if (hdr.type == QRTR_TYPE_DATA) {
+		sock = sock_lookup(hdr.dst_port_id);
+		if (sock)
+			sock_deliver(sock, hdr.src_node_id, hdr.src_port_id,
+				     hdr.confirm_rx, data, len);
+		return;
+	}
+
+	memcpy(&pkt, data, MIN(len, sizeof(pkt)));
+	tun_ctrl(ep, node, &hdr, &pkt);
+}
+
+/* Local sockets */
+
+static void sock_ns(struct lo_sock *sock, const void *data, size_t len)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+
+	memcpy(&pkt, data, MIN(len, sizeof(pkt)));
+
+	switch (pkt.cmd) {
+	case QRTR_TYPE_NEW_SERVER:
+		service_add(&sock->services, pkt.server.service, pkt.server.instance,
+			    QRTR_LOOPBACK_NODE, sock->port);
+		break;
+	case QRTR_TYPE_DEL_SERVER:
+		service_del(&sock->services, pkt.server.service, pkt.server.instance,
+			    QRTR_LOOPBACK_NODE, sock->port);
+		break;
+	case QRTR_TYPE_NEW_LOOKUP:
+		lookup_add(sock, pkt.server.service, pkt.server.instance);
+		break;
+	case QRTR_TYPE_DEL_LOOKUP:
+		lookup_del(sock, false, pkt.server.service, pkt.server.instance);
+		break;
+	}
+}
+
+static int sock_send(struct lo_sock *sock, struct qrtr_lo_hdr *req, const void *data,
+		     size_t len, bool *deferred)
+{
+	struct lo_waiter *waiter;
+	struct lo_flow *flow;
+	struct lo_node *node;
+	struct lo_sock *peer;
+
+	if (req->node == QRTR_LOOPBACK_NODE || req->port == QRTR_PORT_CTRL) {
+		if (req->port == QRTR_PORT_CTRL) {
+			sock_ns(sock, data, len);
+			return len;
+		}
+
+		peer = sock_lookup(req->port);
+		if (!peer)
+			return -ENODEV;
+
+		sock_deliver(peer, QRTR_LOOPBACK_NODE, sock->port, 0, data, len);
+		return len;
+	}
+
+	node = node_lookup(req->node);
+	if (!node)
+		return -ECONNRESET;
+
+	flow = flow_get(req->node, req->port);
+	if (!flow)
+		return -ENOMEM;
+
+	if (flow->pending < FLOW_HIGH && !flow->waiters) {
+		flow_send(flow, node, sock, data, len);
+		return len;
+	}
+
+	if (req->arg & MSG_DONTWAIT)
+		return -EAGAIN;
+
+	waiter = malloc(sizeof(*waiter) + len);
+	if (!waiter)
+		return -ENOMEM;
+
+	waiter->next = NULL;
+	waiter->sock = sock;
+	waiter->len = len;
+	memcpy(waiter->data, data, len);
+
+	*flow->waiters_tail = waiter;
+	flow->waiters_tail = &waiter->next;
+
+	/* The reply is deferred until the remote resumes the flow */
+	*deferred = true;
+
+	return 0;
+}
+
+static void ctl_rx(struct lo_conn *conn, void *buf, size_t len)
+{
+	struct qrtr_lo_hdr *req = buf;
+	struct qrtr_ctrl_pkt pkt = {};
+	struct lo_sock *sock = conn->sock;
+	struct lo_node *node;
+	bool deferred = false;
+	void *data = req + 1;
+	int ret;
+
+	if (len < sizeof(*req))
+		return;
+
+	len -= sizeof(*req);
+
+	switch (req->op) {
+	case QRTR_LO_BIND:
+		if (req->port && req->port != sock->port) {
+			if (sock_lookup(req->port)) {
+				reply(conn, 0, 0, -EADDRINUSE);
+				break;
+			}
+
+			sock_hash_del(sock);
+			sock->port = req->port;
+			sock_hash_add(sock);
+		}
+		/* fall through */
+	case QRTR_LO_GETNAME:
+		reply(conn, QRTR_LOOPBACK_NODE, sock->port, 0);
+		break;
+	case QRTR_LO_SEND:
+		ret = sock_send(sock, req, data, len, &deferred);
+		if (!deferred)
+			reply(conn, 0, 0, ret);
+		break;
+	case QRTR_LO_CONFIRM:
+		node = node_lookup(req->node);
+		if (!node)
+			break;
+
+		pkt.cmd = QRTR_TYPE_RESUME_TX;
+		pkt.client.node = QRTR_LOOPBACK_NODE;
+		pkt.client.port = sock->port;
+
+		ep_send(node->ep, QRTR_TYPE_RESUME_TX, QRTR_LOOPBACK_NODE, sock->port,
+			req->node, req->port, 0, &pkt, sizeof(pkt));
+		break;
+	}
+}
+
+static void conn_free(struct lo_conn *conn)
+{
+	struct lo_buf *buf;
+
+	qrtr_loop_del_fd(lo_loop, conn->fd);
+	close(conn->fd);
+	lo_conns[conn->fd] = NULL;
+
+	while ((buf = conn->head) != NULL) {
+		conn->head = buf->next;
+		free(buf);
+	}
+
+	free(conn);
+}
+
+static void sock_release(struct lo_sock *sock)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+
+	sock_hash_del(sock);
+	service_del_all(&sock->services);
+	lookup_del(sock, true, 0, 0);
+	flows_release(NULL, sock);
+
+	pkt.cmd = QRTR_TYPE_DEL_CLIENT;
+	pkt.client.node = QRTR_LOOPBACK_NODE;
+	pkt.client.port = sock->port;
+	ep_bcast(QRTR_TYPE_DEL_CLIENT, &pkt, sizeof(pkt));
+
+	if (sock->data)
+		conn_free(sock->data);
+	if (sock->ctl)
+		conn_free(sock->ctl);
+	free(sock);
+}
+
+static void conn_close(struct lo_conn *conn)
+{
+	switch (conn->kind) {
+	case CONN_TUN:
+		while (conn->nodes)
+			node_release(conn->nodes);
+		conn_free(conn);
+		break;
+	case CONN_SOCK:
+	case CONN_CTL:
+		sock_release(conn->sock);
+		break;
+	default:
+		conn_free(conn);
+		break;
+	}
+}
+
+static void conn_open(struct lo_conn *conn, struct qrtr_lo_hdr *req)
+{
+	struct lo_sock *sock;
+
+	switch (req->op) {
+	case QRTR_LO_OPEN_TUN:
+		conn->kind = CONN_TUN;
+		reply(conn, 0, 0, 0);
+		break;
+	case QRTR_LO_OPEN_SOCK:
+		sock = calloc(1, sizeof(*sock));
+		if (!sock) {
+			conn_close(conn);
+			return;
+		}
+
+		do {
+			sock->port = lo_next_port++;
+			if (lo_next_port > 0x7fff)
+				lo_next_port = 0x4000;
+		} while (sock_lookup(sock->port));
+
+		sock->data = conn;
+		sock_hash_add(sock);
+
+		conn->kind = CONN_SOCK;
+		conn->sock = sock;
+		reply(conn, QRTR_LOOPBACK_NODE, sock->port, 0);
+		break;
+	case QRTR_LO_OPEN_CTL:
+		sock = sock_lookup(req->port);
+		if (!sock || sock->ctl) {
+			reply(conn, 0, 0, -ENOENT);
+			return;
+		}
+
+		sock->ctl = conn;
+
+		conn->kind = CONN_CTL;
+		conn->sock = sock;
+		reply(conn, QRTR_LOOPBACK_NODE, sock->port, 0);
+		break;
+	default:
+		conn_close(conn);
+		break;
+	}
+}
+
+static void conn_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	static char buf[RX_BUF_SIZE];
+	struct lo_conn *conn = data;
+	ssize_t n;
+
+	if (events & EPOLLOUT)
+		conn_flush(conn);
+
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if (n <= 0) {
+		conn_close(conn);
+		return;
+	}
+
+	switch (conn->kind) {
+	case CONN_NEW:
+		if (n >= sizeof(struct qrtr_lo_hdr))
+			conn_open(conn, (struct qrtr_lo_hdr *)buf);
+		break;
+	case CONN_TUN:
+		tun_rx(conn, buf, n);
+		break;
+	case CONN_CTL:
+		ctl_rx(conn, buf, n);
+		break;
+	}
+}
+
+static void listen_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	struct lo_conn **conns;
+	struct lo_conn *conn;
+	unsigned int n;
+	int cfd;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (cfd < 0)
+		return;
+
+	if (cfd >= lo_nconns) {
+		n = MAX(cfd + 1, 2 * lo_nconns);
+
+		conns = realloc(lo_conns, n * sizeof(*conns));
+		if (!conns) {
+			close(cfd);
+			return;
+		}
+
+		memset(conns + lo_nconns, 0, (n - lo_nconns) * sizeof(*conns));
+		lo_conns = conns;
+		lo_nconns = n;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		close(cfd);
+		return;
+	}
+
+	conn->fd = cfd;
+	conn->kind = CONN_NEW;
+	lo_conns[cfd] = conn;
+
+	qrtr_loop_add_fd(loop, cfd, EPOLLIN, conn_event, conn);
+}
+
+static void life_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	_exit(0);
+}
+
+static void close_other_fds(int a, int b)
+{
+	int lo = MIN(a, b);
+	int hi = MAX(a, b);
+#ifdef __NR_close_range
+	if (lo > 3)
+		syscall(__NR_close_range, 3, lo - 1, 0);
+	if (hi > lo + 1)
+		syscall(__NR_close_range, lo + 1, hi - 1, 0);
+	syscall(__NR_close_range, hi + 1, ~0u, 0);
+#else
+	long max = sysconf(_SC_OPEN_MAX);
+	int fd;
+
+	for (fd = 3; fd < max; fd++) {
+		if (fd != lo && fd != hi)
+			close(fd);
+	}
+#endif
+}
+
+static void router_main(int listen_fd, int life_fd)
+{
+	close_other_fds(listen_fd, life_fd);
+
+	lo_loop = qrtr_loop_new();
+	if (!lo_loop)
+		err(1, "[loopback] failed to create event loop");
+
+	qrtr_loop_add_fd(lo_loop, listen_fd, EPOLLIN, listen_event, NULL);
+	qrtr_loop_add_fd(lo_loop, life_fd, EPOLLIN, life_event, NULL);
+
+	qrtr_loop_run(lo_loop);
+}
+
+static void make_addr(struct sockaddr_un *sun, socklen_t *len, const char *name)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strncpy(sun->sun_path + 1, name, sizeof(sun->sun_path) - 2);
+
+	*len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun->sun_path + 1);
+}
+
+static const char *router_start(void)
+{
+	struct sockaddr_un sun;
+	const char *name;
+	char buf[64];
+	socklen_t len;
+	int life[2];
+	int fd;
+	int pid;
+
+	name = getenv(QRTR_LOOPBACK_ENV);
+	if (name)
+		return name;
+
+	snprintf(buf, sizeof(buf), "qrtr-loopback-%d", getpid());
+	make_addr(&sun, &len, buf);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "[loopback] failed to create listening socket");
+
+	if (bind(fd, (void *)&sun, len) < 0 || listen(fd, 128) < 0)
+		err(1, "[loopback] failed to listen");
+
+	/* The router exits once every holder of life[1] has gone away */
+	if (pipe2(life, O_CLOEXEC) < 0)
+		err(1, "[loopback] failed to create pipe");
+
+	/* Detach the router, so it doesn't show up in the tests' wait() */
+	pid = fork();
+	if (pid < 0)
+		err(1, "[loopback] fork failed");
+
+	if (!pid) {
+		if (fork() == 0)
+			router_main(fd, life[0]);
+		_exit(0);
+	}
+
+	waitpid(pid, NULL, 0);
+
+	close(fd);
+	close(life[0]);
+
+	setenv(QRTR_LOOPBACK_ENV, buf, 1);
+
+	return getenv(QRTR_LOOPBACK_ENV);
+}
+
+static int router_connect(struct qrtr_lo_hdr *req)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	ssize_t n;
+	int fd;
+
+	make_addr(&sun, &len, router_start());
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (void *)&sun, len) < 0)
+		goto err;
+
+	n = send(fd, req, sizeof(*req), MSG_NOSIGNAL);
+	if (n != sizeof(*req))
+		goto err;
+
+	n = recv(fd, req, sizeof(*req), 0);
+	if (n != sizeof(*req) || req->op != QRTR_LO_REPLY)
+		goto err;
+
+	if (req->arg < 0) {
+		errno = -req->arg;
+		goto err;
+	}
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+int qrtr_loopback_tun_open(void)
+{
+	struct qrtr_lo_hdr req = { QRTR_LO_OPEN_TUN };
+
+	return router_connect(&req);
+}
+
+int qrtr_loopback_socket(int *ctl_fd)
+{
+	struct qrtr_lo_hdr req = { QRTR_LO_OPEN_SOCK };
+	int fd;
+
+	fd = router_connect(&req);
+	if (fd < 0)
+		return -1;
+
+	req.op = QRTR_LO_OPEN_CTL;
+	*ctl_fd = router_connect(&req);
+	if (*ctl_fd < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Issue a request on the control channel of a socket; the reply header is
+ * returned in req. CONFIRM requests are not answered.
+ */
+int qrtr_loopback_call(int ctl_fd, struct qrtr_lo_hdr *req, const void *data, size_t len)
+{
+	struct msghdr msg = {};
+	struct iovec iov[2];
+	ssize_t n;
+
+	iov[0].iov_base = req;
+	iov[0].iov_len = sizeof(*req);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	n = sendmsg(ctl_fd, &msg, MSG_NOSIGNAL);
+	if (n < 0)
+		return -1;
+
+	if (req->op == QRTR_LO_CONFIRM)
+		return 0;
+
+	do {
+		n = recv(ctl_fd, req, sizeof(*req), 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n != sizeof(*req) || req->op != QRTR_LO_REPLY) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (req->arg < 0) {
+		errno = -req->arg;
+		return -1;
+	}
+
+	return req->arg;
+}
@@ -0,0 +1,42 @@
+#ifndef __QRTR_LOOPBACK_H__
+#define __QRTR_LOOPBACK_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "qrtr.h"
+
+/*
+ * Userspace stand-in for the kernel QRTR router, used when QRTR_TRANSPORT is
+ * set to "loopback". See qrtr-loopback.c for details.
+ */
+
+#define QRTR_LOOPBACK_ENV	"QRTR_LOOPBACK"
+
+#define QRTR_LOOPBACK_NODE	1
+
+enum {
+	QRTR_LO_OPEN_TUN = 1,
+	QRTR_LO_OPEN_SOCK,
+	QRTR_LO_OPEN_CTL,
+	QRTR_LO_REPLY,
+	QRTR_LO_DATA,
+	QRTR_LO_BIND,
+	QRTR_LO_GETNAME,
+	QRTR_LO_SEND,
+	QRTR_LO_CONFIRM,
+};
+
+/* Framing of messages on the socket data and control channels */
+struct qrtr_lo_hdr {
+	uint32_t op;
+	uint32_t node;
+	uint32_t port;
+	int32_t arg;
+};
+
+int qrtr_loopback_tun_open(void);
+int qrtr_loopback_socket(int *ctl_fd);
+int qrtr_loopback_call(int ctl_fd, struct qrtr_lo_hdr *req, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,212 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "qrtr-loop.h"
+#include "util.h"
+
+/*
+ * Register a large number of nodes spread over a set of qrtr-tun endpoints,
+ * all driven from a single event loop, and check that each node is greeted
+ * back and then receives a ping sent to it.
+ *
+ * Every node has its own timer, failing the node if the next step isn't
+ * reached within NODE_TIMEOUT milliseconds.
+ */
+
+#define NODE_TIMEOUT	5000
+
+enum {
+	REMOTE_WAIT_HELLO,
+	REMOTE_WAIT_PING,
+	REMOTE_DONE,
+	REMOTE_FAILED,
+};
+
+struct remote {
+	struct qrtr_node *node;
+	struct qrtr_timer timer;
+
+	int state;
+};
+
+static struct remote *remotes;
+static unsigned remote_count = 1024;
+static unsigned tun_count = 16;
+static unsigned pending;
+static struct qrtr_pool *pool;
+static int sock;
+
+static void remote_finish(struct qrtr_loop *loop, struct remote *remote, int state)
+{
+	qrtr_timer_cancel(loop, &remote->timer);
+
+	remote->state = state;
+
+	if (!--pending)
+		qrtr_loop_quit(loop);
+}
+
+static void remote_timeout(struct qrtr_loop *loop, struct qrtr_timer *timer)
+{
+	struct remote *remote = container_of(timer, struct remote, timer);
+
+	warnx("node %d timed out waiting for %s", remote->node->node_id,
+	      remote->state == REMOTE_WAIT_HELLO ? "hello" : "ping");
+
+	remote->state = REMOTE_FAILED;
+
+	if (!--pending)
+		qrtr_loop_quit(loop);
+}
+
+static void send_ping(struct remote *remote)
+{
+	struct sockaddr_qrtr sq = { AF_QIPCRTR, remote->node->node_id, 1 };
+	const char ping[] = "ping";
+	ssize_t n;
+
+	n = qrtr_sendto(sock, ping, 4, 0, &sq);
+	if (n < 0)
+		warn("failed to send ping to %d", sq.sq_node);
+}
+
+static void tun_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	struct remote *remote;
+	struct qrtr_pkt *pkt;
+	unsigned idx;
+	int type;
+
+	pkt = qrtr_pkt_read(pool, fd);
+	if (!pkt)
+		err(1, "failed to read");
+
+	type = pkt->hdr->type;
+	idx = pkt->hdr->dst_node_id - qrtr_test_node(0);
+
+	qrtr_pkt_put(pkt);
+
+	if (idx >= remote_count)
+		return;
+
+	remote = &remotes[idx];
+
+	switch (type) {
+	case QRTR_TYPE_HELLO:
+		if (remote->state != REMOTE_WAIT_HELLO)
+			break;
+
+		remote->state = REMOTE_WAIT_PING;
+		qrtr_timer_arm(loop, &remote->timer, NODE_TIMEOUT);
+		send_ping(remote);
+		break;
+	case QRTR_TYPE_DATA:
+		if (remote->state == REMOTE_WAIT_PING)
+			remote_finish(loop, remote, REMOTE_DONE);
+		break;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-many-remotes [-n nodes] [-t tuns]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct qrtr_loop *loop;
+	unsigned failed = 0;
+	int *tun_fds;
+	int opt;
+	int ret;
+	int i;
+
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			remote_count = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tun_count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!remote_count || !tun_count)
+		usage();
+
+	sock = qrtr_socket();
+	if (sock < 0)
+		err(1, "creating AF_QIPCRTR socket failed");
+
+	loop = qrtr_loop_new();
+	if (!loop)
+		err(1, "failed to create event loop");
+
+	pool = qrtr_pool_shared();
+	if (!pool)
+		err(1, "failed to allocate receive buffers");
+
+	tun_fds = calloc(tun_count, sizeof(*tun_fds));
+	remotes = calloc(remote_count, sizeof(*remotes));
+	if (!tun_fds || !remotes)
+		err(1, "failed to allocate remotes");
+
+	for (i = 0; i < tun_count; i++) {
+		tun_fds[i] = qrtr_tun_open();
+		if (tun_fds[i] < 0)
+			err(1, "failed to open qrtr-tun");
+
+		ret = qrtr_loop_add_fd(loop, tun_fds[i], EPOLLIN, tun_event, NULL);
+		if (ret < 0)
+			err(1, "failed to watch qrtr-tun");
+	}
+
+	for (i = 0; i < remote_count; i++) {
+		remotes[i].node = qrtr_node_new(qrtr_test_node(i), tun_fds[i % tun_count]);
+		remotes[i].state = REMOTE_WAIT_HELLO;
+		qrtr_timer_init(&remotes[i].timer, remote_timeout);
+		qrtr_timer_arm(loop, &remotes[i].timer, NODE_TIMEOUT);
+
+		ret = qrtr_node_hello(remotes[i].node);
+		if (ret < 0)
+			err(1, "failed to hello node %d", remotes[i].node->node_id);
+	}
+
+	pending = remote_count;
+
+	ret = qrtr_loop_run(loop);
+	if (ret < 0)
+		err(1, "event loop failed");
+
+	for (i = 0; i < remote_count; i++) {
+		if (remotes[i].state != REMOTE_DONE)
+			failed++;
+	}
+
+	metric_count("pass", remote_count - failed);
+	metric_count("fail", failed);
+
+	printf("%u of %u nodes on %u endpoints passed\n",
+	       remote_count - failed, remote_count, tun_count);
+
+	return !!failed;
+}
@@ -0,0 +1,260 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qrtr-memstat.h"
+#include "qrtr-metrics.h"
+#include "util.h"
+
+/*
+ * Kernel memory footprint of a test run.
+ *
+ * A background thread samples, at a fixed interval, the memory held by the
+ * skbuff and kmalloc slab caches according to /proc/slabinfo, the receive and
+ * send buffer memory of the given sockets through SO_MEMINFO, and the
+ * system's MemAvailable. The first sample is the baseline. When stopped the
+ * peak growth over the baseline is reported, in total and per packet of the
+ * run, along with the matching metrics.
+ *
+ * net/qrtr has no slab cache of its own: packets are skbs, with their data and
+ * the per node and per port state coming from the generic kmalloc-* caches.
+ * Slab and MemAvailable figures are system wide, so anything else running
+ * shows up as well; /proc/slabinfo is only readable by root, without it the
+ * slab figures are left out.
+ */
+
+#define MAX_SOCKS	64
+
+enum {
+	MEM_SKBUFF,
+	MEM_KMALLOC,
+	MEM_SOCKETS,
+	MEM_AVAILABLE,
+	MEM_COUNT,
+};
+
+static const char * const mem_names[MEM_COUNT] = {
+	[MEM_SKBUFF] = "skbuff_slab",
+	[MEM_KMALLOC] = "kmalloc_slab",
+	[MEM_SOCKETS] = "socket_mem",
+	[MEM_AVAILABLE] = "mem_available",
+};
+
+struct qrtr_memstat {
+	pthread_t thread;
+	bool stop;
+
+	unsigned int interval_ms;
+
+	int socks[MAX_SOCKS];
+	unsigned int nsocks;
+
+	bool valid[MEM_COUNT];
+
+	uint64_t samples;
+	uint64_t baseline[MEM_COUNT];
+
+	/* Highest value seen, lowest for MemAvailable */
+	uint64_t extreme[MEM_COUNT];
+};
+
+static bool sample_slabs(uint64_t *skbuff, uint64_t *kmalloc)
+{
+	unsigned long active;
+	unsigned long size;
+	char name[64];
+	char line[512];
+	FILE *fp;
+
+	fp = fopen("/proc/slabinfo", "r");
+	if (!fp)
+		return false;
+
+	*skbuff = 0;
+	*kmalloc = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s %lu %*u %lu", name, &active, &size) != 3)
+			continue;
+
+		if (!strncmp(name, "skbuff", 6))
+			*skbuff += (uint64_t)active * size;
+		else if (!strncmp(name, "kmalloc-", 8))
+			*kmalloc += (uint64_t)active * size;
+	}
+
+	fclose(fp);
+
+	return true;
+}
+
+static bool sample_mem_available(uint64_t *avail)
+{
+	unsigned long kb;
+	char line[128];
+	bool found = false;
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return false;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+			*avail = kb * 1024;
+			found = true;
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return found;
+}
+
+static bool sample_sockets(struct qrtr_memstat *ms, uint64_t *mem)
+{
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len;
+	bool found = false;
+	unsigned int i;
+
+	*mem = 0;
+
+	for (i = 0; i < ms->nsocks; i++) {
+		len = sizeof(meminfo);
+		if (getsockopt(ms->socks[i], SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0)
+			continue;
+
+		*mem += meminfo[SK_MEMINFO_RMEM_ALLOC] + meminfo[SK_MEMINFO_WMEM_ALLOC] +
+			meminfo[SK_MEMINFO_WMEM_QUEUED] + meminfo[SK_MEMINFO_BACKLOG];
+		found = true;
+	}
+
+	return found;
+}
+
+static void memstat_sample(struct qrtr_memstat *ms)
+{
+	uint64_t values[MEM_COUNT];
+	bool valid[MEM_COUNT];
+	bool low;
+	int i;
+
+	valid[MEM_SKBUFF] = valid[MEM_KMALLOC] = sample_slabs(&values[MEM_SKBUFF], &values[MEM_KMALLOC]);
+	valid[MEM_SOCKETS] = sample_sockets(ms, &values[MEM_SOCKETS]);
+	valid[MEM_AVAILABLE] = sample_mem_available(&values[MEM_AVAILABLE]);
+
+	for (i = 0; i < MEM_COUNT; i++) {
+		if (!valid[i])
+			continue;
+
+		low = i == MEM_AVAILABLE;
+
+		if (!ms->valid[i]) {
+			ms->valid[i] = true;
+			ms->baseline[i] = values[i];
+			ms->extreme[i] = values[i];
+		} else if (low ? values[i] < ms->extreme[i] : values[i] > ms->extreme[i]) {
+			ms->extreme[i] = values[i];
+		}
+	}
+
+	ms->samples++;
+}
+
+static void *memstat_thread(void *data)
+{
+	struct qrtr_memstat *ms = data;
+	struct timespec ts;
+
+	ts.tv_sec = ms->interval_ms / 1000;
+	ts.tv_nsec = (ms->interval_ms % 1000) * 1000000;
+
+	while (!__atomic_load_n(&ms->stop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&ts, NULL);
+		memstat_sample(ms);
+	}
+
+	return NULL;
+}
+
+/* Take the baseline and start sampling every interval_ms */
+struct qrtr_memstat *qrtr_memstat_start(unsigned int interval_ms, const int *socks, unsigned int nsocks)
+{
+	struct qrtr_memstat *ms;
+	int ret;
+
+	ms = calloc(1, sizeof(*ms));
+	if (!ms)
+		err(1, "failed to allocate memory sampler");
+
+	ms->interval_ms = MAX(interval_ms, 1);
+	ms->nsocks = MIN(nsocks, MAX_SOCKS);
+	memcpy(ms->socks, socks, ms->nsocks * sizeof(*socks));
+
+	memstat_sample(ms);
+
+	ret = pthread_create(&ms->thread, NULL, memstat_thread, ms);
+	if (ret) {
+		errno = ret;
+		err(1, "failed to start memory sampler");
+	}
+
+	return ms;
+}
+
+/* Stop sampling and report the peak memory use, packets is the run's count */
+void qrtr_memstat_stop(struct qrtr_memstat *ms, uint64_t packets)
+{
+	char name[64];
+	int64_t delta;
+	int i;
+
+	__atomic_store_n(&ms->stop, true, __ATOMIC_RELEASE);
+	pthread_join(ms->thread, NULL);
+
+	memstat_sample(ms);
+
+	printf("kernel memory, %llu samples every %u ms\n",
+	       (unsigned long long)ms->samples, ms->interval_ms);
+	printf("  %-14s %12s %12s %12s %10s\n", "", "baseline kB", "peak kB", "growth kB", "B/packet");
+
+	for (i = 0; i < MEM_COUNT; i++) {
+		if (!ms->valid[i]) {
+			printf("  %-14s %12s\n", mem_names[i], "n/a");
+			continue;
+		}
+
+		/* For MemAvailable the growth is how much it dropped */
+		if (i == MEM_AVAILABLE)
+			delta = ms->baseline[i] - ms->extreme[i];
+		else
+			delta = ms->extreme[i] - ms->baseline[i];
+
+		printf("  %-14s %12llu %12llu %12lld %10.1f\n", mem_names[i],
+		       (unsigned long long)ms->baseline[i] / 1024,
+		       (unsigned long long)ms->extreme[i] / 1024,
+		       (long long)delta / 1024,
+		       packets ? (double)delta / packets : 0.0);
+
+		snprintf(name, sizeof(name), "mem.%s.peak_bytes", mem_names[i]);
+		metric_gauge(name, ms->extreme[i]);
+		snprintf(name, sizeof(name), "mem.%s.growth_bytes", mem_names[i]);
+		metric_gauge(name, delta);
+		snprintf(name, sizeof(name), "mem.%s.bytes_per_packet", mem_names[i]);
+		metric_gauge(name, packets ? (double)delta / packets : 0.0);
+	}
+
+	free(ms);
+}
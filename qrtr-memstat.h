@@ -0,0 +1,11 @@
+#ifndef __QRTR_MEMSTAT_H__
+#define __QRTR_MEMSTAT_H__
+
+#include <stdint.h>
+
+struct qrtr_memstat;
+
+struct qrtr_memstat *qrtr_memstat_start(unsigned int interval_ms, const int *socks, unsigned int nsocks);
+void qrtr_memstat_stop(struct qrtr_memstat *ms, uint64_t packets);
+
+#endif
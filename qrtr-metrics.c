@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr-metrics.h"
+#include "util.h"
+
+/*
+ * Named counters, gauges and histograms, reported as one JSON document per
+ * process at exit.
+ *
+ * Each thread records into its own store, found through a thread local
+ * pointer, so recording never takes a lock; only the first use in a thread
+ * links its store into the list that is merged at exit. Counters are summed
+ * and histograms merged across threads, while for gauges the value set last
+ * wins. Hot paths can look up a counter or histogram once and update it
+ * directly; metrics are allocated in fixed chunks, so these pointers stay
+ * valid as a store grows.
+ *
+ * Recording never fails the process: a name that can't be stored is warned
+ * about once and its values are discarded.
+ *
+ * Setting QRTR_METRICS to a path appends the document of each process,
+ * including forked children that recorded anything, as a single line to that
+ * file; "-" writes to stdout. Without it nothing is emitted.
+ */
+
+#define METRIC_NAME_LEN		64
+#define METRIC_CHUNK		64
+
+enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HIST,
+};
+
+struct metric {
+	char name[METRIC_NAME_LEN];
+	int type;
+
+	uint64_t count;
+
+	double value;
+	uint64_t stamp;
+
+	const char *unit;
+	struct histogram *hist;
+};
+
+struct metric_chunk {
+	struct metric metrics[METRIC_CHUNK];
+};
+
+struct metric_store {
+	struct metric_store *next;
+
+	unsigned int count;
+
+	struct metric_chunk **chunks;
+	unsigned int nchunks;
+};
+
+static __thread struct metric_store *local_store;
+
+static __thread struct metric discard;
+static __thread struct histogram discard_hist;
+static bool discard_warned;
+
+static pthread_mutex_t stores_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static struct metric_store *stores;
+
+static void metrics_emit(void);
+
+static struct metric *store_metric(struct metric_store *store, unsigned int idx)
+{
+	return &store->chunks[idx / METRIC_CHUNK]->metrics[idx % METRIC_CHUNK];
+}
+
+/* Scratch metric taking the values of names that can't be stored */
+static struct metric *metric_discard(const char *name, int type, const char *why)
+{
+	if (!discard_warned) {
+		warnx("discarding metric %s: %s", name, why);
+		discard_warned = true;
+	}
+
+	if (!discard.hist) {
+		hist_init(&discard_hist);
+		discard.hist = &discard_hist;
+	}
+
+	discard.type = type;
+
+	return &discard;
+}
+
+static bool store_grow(struct metric_store *store)
+{
+	struct metric_chunk **chunks;
+	struct metric_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk));
+	if (!chunk)
+		return false;
+
+	chunks = realloc(store->chunks, (store->nchunks + 1) * sizeof(*chunks));
+	if (!chunks) {
+		free(chunk);
+		return false;
+	}
+
+	chunks[store->nchunks++] = chunk;
+	store->chunks = chunks;
+
+	return true;
+}
+
+/* Drop what the parent recorded, the child reports only its own metrics */
+static void metrics_atfork_child(void)
+{
+	struct metric_store *store;
+	unsigned int i;
+
+	pthread_mutex_init(&stores_lock, NULL);
+
+	for (store = stores; store; store = store->next) {
+		for (i = 0; i < store->count; i++)
+			free(store_metric(store, i)->hist);
+
+		store->count = 0;
+	}
+}
+
+static void metrics_init(void)
+{
+	pthread_atfork(NULL, NULL, metrics_atfork_child);
+	atexit(metrics_emit);
+}
+
+static struct metric *metric_get(const char *name, int type)
+{
+	struct metric_store *store = local_store;
+	struct metric *metric;
+	unsigned int i;
+
+	if (!store) {
+		pthread_once(&metrics_once, metrics_init);
+
+		store = calloc(1, sizeof(*store));
+		if (!store)
+			return metric_discard(name, type, "out of memory");
+
+		pthread_mutex_lock(&stores_lock);
+		store->next = stores;
+		stores = store;
+		pthread_mutex_unlock(&stores_lock);
+
+		local_store = store;
+	}
+
+	for (i = 0; i < store->count; i++) {
+		metric = store_metric(store, i);
+
+		if (!strcmp(metric->name, name)) {
+			if (metric->type != type)
+				return metric_discard(name, type, "recorded as different types");
+			return metric;
+		}
+	}
+
+	if (strlen(name) >= METRIC_NAME_LEN)
+		return metric_discard(name, type, "name too long");
+
+	if (store->count == store->nchunks * METRIC_CHUNK && !store_grow(store))
+		return metric_discard(name, type, "out of memory");
+
+	metric = store_metric(store, store->count++);
+	memset(metric, 0, sizeof(*metric));
+	strcpy(metric->name, name);
+	metric->type = type;
+
+	return metric;
+}
+
+uint64_t *metric_counter(const char *name)
+{
+	return &metric_get(name, METRIC_COUNTER)->count;
+}
+
+void metric_count(const char *name, uint64_t delta)
+{
+	*metric_counter(name) += delta;
+}
+
+void metric_gauge(const char *name, double value)
+{
+	struct metric *metric = metric_get(name, METRIC_GAUGE);
+
+	metric->value = value;
+	metric->stamp = time_ns();
+}
+
+struct histogram *metric_hist(const char *name, const char *unit)
+{
+	struct metric *metric = metric_get(name, METRIC_HIST);
+
+	if (!metric->hist) {
+		metric->hist = malloc(sizeof(*metric->hist));
+		if (!metric->hist)
+			return metric_discard(name, METRIC_HIST, "out of memory")->hist;
+
+		hist_init(metric->hist);
+		metric->unit = unit;
+	}
+
+	return metric->hist;
+}
+
+void metric_time(const char *name, uint64_t ns)
+{
+	hist_record(metric_hist(name, "ns"), ns);
+}
+
+/* Fold the metrics of all threads into the first store holding each name */
+static unsigned int metrics_merge(struct metric **merged)
+{
+	struct metric_store *store;
+	struct metric *metric;
+	struct metric *dst;
+	unsigned int count = 0;
+	unsigned int i;
+	unsigned int j;
+
+	for (store = stores; store; store = store->next) {
+		for (i = 0; i < store->count; i++) {
+			metric = store_metric(store, i);
+
+			for (j = 0; j < count; j++) {
+				if (!strcmp(merged[j]->name, metric->name))
+					break;
+			}
+
+			if (j == count) {
+				merged[count++] = metric;
+				continue;
+			}
+
+			dst = merged[j];
+			if (dst->type != metric->type)
+				continue;
+
+			switch (dst->type) {
+			case METRIC_COUNTER:
+				dst->count += metric->count;
+				break;
+			case METRIC_GAUGE:
+				if (metric->stamp > dst->stamp) {
+					dst->value = metric->value;
+					dst->stamp = metric->stamp;
+				}
+				break;
+			case METRIC_HIST:
+				if (dst->hist && metric->hist)
+					hist_merge(dst->hist, metric->hist);
+				break;
+			}
+		}
+	}
+
+	return count;
+}
+
+static void print_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+
+		if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+
+	fputc('"', fp);
+}
+
+static void print_section(FILE *fp, const char *section, struct metric **metrics,
+			  unsigned int count, int type)
+{
+	const struct histogram *hist;
+	struct metric *metric;
+	bool first = true;
+	unsigned int i;
+
+	fprintf(fp, ",\"%s\":{", section);
+
+	for (i = 0; i < count; i++) {
+		metric = metrics[i];
+		if (metric->type != type)
+			continue;
+
+		/* Its histogram failed to allocate */
+		if (type == METRIC_HIST && !metric->hist)
+			continue;
+
+		if (!first)
+			fputc(',', fp);
+		first = false;
+
+		print_string(fp, metric->name);
+		fputc(':', fp);
+
+		switch (type) {
+		case METRIC_COUNTER:
+			fprintf(fp, "%llu", (unsigned long long)metric->count);
+			break;
+		case METRIC_GAUGE:
+			fprintf(fp, "%.17g", metric->value);
+			break;
+		case METRIC_HIST:
+			hist = metric->hist;
+
+			fputs("{\"unit\":", fp);
+			print_string(fp, metric->unit ? metric->unit : "");
+			fprintf(fp, ",\"count\":%llu", (unsigned long long)hist->count);
+
+			if (hist->count) {
+				fprintf(fp, ",\"min\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p99.9\":%llu,\"max\":%llu",
+					(unsigned long long)hist->min,
+					(unsigned long long)(hist->sum / hist->count),
+					(unsigned long long)hist_percentile(hist, 50),
+					(unsigned long long)hist_percentile(hist, 90),
+					(unsigned long long)hist_percentile(hist, 99),
+					(unsigned long long)hist_percentile(hist, 99.9),
+					(unsigned long long)hist->max);
+			}
+
+			fputc('}', fp);
+			break;
+		}
+	}
+
+	fputc('}', fp);
+}
+
+static void metrics_emit(void)
+{
+	struct metric_store *store;
+	struct metric **merged;
+	const char *path;
+	unsigned int count;
+	size_t len;
+	char *buf;
+	FILE *fp;
+	ssize_t n;
+	int fd;
+
+	path = getenv(QRTR_METRICS_ENV);
+	if (!path)
+		return;
+
+	count = 0;
+	for (store = stores; store; store = store->next)
+		count += store->count;
+
+	if (!count)
+		return;
+
+	merged = calloc(count, sizeof(*merged));
+	if (!merged) {
+		warn("failed to allocate metrics report");
+		return;
+	}
+
+	count = metrics_merge(merged);
+
+	/* Build the document in memory, so it's appended in one write */
+	fp = open_memstream(&buf, &len);
+	if (!fp) {
+		free(merged);
+		return;
+	}
+
+	fputs("{\"program\":", fp);
+	print_string(fp, program_invocation_short_name);
+	fprintf(fp, ",\"pid\":%d,\"ppid\":%d", getpid(), getppid());
+
+	print_section(fp, "counters", merged, count, METRIC_COUNTER);
+	print_section(fp, "gauges", merged, count, METRIC_GAUGE);
+	print_section(fp, "histograms", merged, count, METRIC_HIST);
+
+	fputs("}\n", fp);
+	fclose(fp);
+
+	free(merged);
+
+	if (!strcmp(path, "-")) {
+		fflush(stdout);
+		fd = STDOUT_FILENO;
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			warn("failed to open metrics file %s", path);
+			free(buf);
+			return;
+		}
+	}
+
+	n = write(fd, buf, len);
+	if (n != len)
+		warn("failed to write metrics");
+
+	if (fd != STDOUT_FILENO)
+		close(fd);
+
+	free(buf);
+}
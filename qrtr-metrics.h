@@ -0,0 +1,17 @@
+#ifndef __QRTR_METRICS_H__
+#define __QRTR_METRICS_H__
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define QRTR_METRICS_ENV	"QRTR_METRICS"
+
+void metric_count(const char *name, uint64_t delta);
+void metric_gauge(const char *name, double value);
+void metric_time(const char *name, uint64_t ns);
+
+uint64_t *metric_counter(const char *name);
+struct histogram *metric_hist(const char *name, const char *unit);
+
+#endif
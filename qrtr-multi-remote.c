@@ -3,6 +3,9 @@
 #include <sys/uio.h>
 #include <err.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -10,20 +13,32 @@
 
 #include "qrtr.h"
 #include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "histogram.h"
 #include "util.h"
 
 /*
  * Register two nodes on a single endpoint, simulating a remote with multiple
  * CPUs, and send a simple message to each one.
+ *
+ * With -n the test instead registers the given number of nodes, spread over
+ * -t endpoints, as a gateway aggregating many downstream processors would,
+ * and measures how the router copes with a growing node table; see
+ * run_scale().
  */
 
+#define SCALE_TIMEOUT	5000
+#define SCALE_PROBES	64
+#define SCALE_FIRST	16
+
 static ssize_t send_ping(int sock, int node)
 {
 	struct sockaddr_qrtr sq = { AF_QIPCRTR, node, 1 };
 	char ping[] = "ping";
 	ssize_t n;
 
-	n = sendto(sock, ping, 4, 0, (void *)&sq, sizeof(sq));
+	n = qrtr_sendto(sock, ping, 4, 0, &sq);
 	if (n < 0)
 		warn("failed to send ping to %d", node);
 
@@ -58,6 +73,7 @@ static void pass(const char *msg)
 	fprintf(stderr, "[PASS]: %s\n", msg);
 
 	test_passes++;
+	metric_count("pass", 1);
 }
 
 static void fail(const char *msg)
@@ -65,37 +81,282 @@ static void fail(const char *msg)
 	fprintf(stderr, "[FAIL]: %s\n", msg);
 
 	test_fails++;
+	metric_count("fail", 1);
+}
+
+enum {
+	PROBE_FIRST,
+	PROBE_LAST,
+	PROBE_RANDOM,
+	PROBE_COUNT,
+};
+
+static const char * const probe_names[PROBE_COUNT] = {
+	[PROBE_FIRST] = "first",
+	[PROBE_LAST] = "last",
+	[PROBE_RANDOM] = "random",
+};
+
+static struct qrtr_node **scale_nodes;
+static unsigned int scale_count;
+static int *scale_fds;
+static unsigned int scale_tuns;
+static struct qrtr_pool *scale_pool;
+
+/*
+ * Wait for a packet of the given type addressed to @node_id, on any of the
+ * endpoints so that traffic for the other nodes doesn't pile up meanwhile.
+ * Data packets asking for it are acknowledged, so probing a node repeatedly
+ * doesn't run into flow control.
+ */
+static void scale_wait(int type, int node_id)
+{
+	struct pollfd pfds[scale_tuns];
+	struct qrtr_node *node;
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
+	unsigned int idx;
+	bool found = false;
+	int ret;
+	int i;
+
+	for (i = 0; i < scale_tuns; i++) {
+		pfds[i].fd = scale_fds[i];
+		pfds[i].events = POLLIN;
+	}
+
+	while (!found) {
+		ret = poll(pfds, scale_tuns, SCALE_TIMEOUT);
+		if (ret < 0)
+			err(1, "poll failed");
+		if (!ret)
+			errx(1, "node %d timed out waiting for %s", node_id,
+			     type == QRTR_TYPE_HELLO ? "hello" : "ping");
+
+		for (i = 0; i < scale_tuns; i++) {
+			if (!pfds[i].revents)
+				continue;
+
+			pkt = qrtr_pkt_read(scale_pool, pfds[i].fd);
+			if (!pkt)
+				err(1, "failed to read");
+
+			hdr = pkt->hdr;
+			idx = hdr->dst_node_id - qrtr_test_node(0);
+
+			if (hdr->type == QRTR_TYPE_DATA && hdr->confirm_rx && idx < scale_count) {
+				node = scale_nodes[idx];
+				qrtr_resume_tx(node, hdr->dst_node_id, hdr->dst_port_id,
+					       hdr->src_node_id, hdr->src_port_id);
+			}
+
+			if (hdr->type == type && hdr->dst_node_id == node_id)
+				found = true;
+
+			qrtr_pkt_put(pkt);
+		}
+	}
+}
+
+static uint64_t scale_hello(unsigned int idx)
+{
+	uint64_t start = time_ns();
+	ssize_t n;
+
+	n = qrtr_node_hello(scale_nodes[idx]);
+	if (n < 0)
+		err(1, "failed to hello node %d", scale_nodes[idx]->node_id);
+
+	scale_wait(QRTR_TYPE_HELLO, scale_nodes[idx]->node_id);
+
+	return time_ns() - start;
+}
+
+static uint64_t scale_deliver(int sock, unsigned int idx)
+{
+	uint64_t start = time_ns();
+
+	send_ping(sock, scale_nodes[idx]->node_id);
+	scale_wait(QRTR_TYPE_DATA, scale_nodes[idx]->node_id);
+
+	return time_ns() - start;
+}
+
+/*
+ * Register node_count nodes, one HELLO at a time, timing each until the
+ * router's HELLO comes back. Each time the node table has doubled, starting
+ * at SCALE_FIRST nodes, and once all nodes are registered, the one way
+ * delivery latency of a ping, from sendto() until it's read off the node's
+ * endpoint, is measured towards the first and the last registered node and to
+ * randomly picked ones. With a hashed node table these stay flat as the
+ * table grows, while a linear lookup shows up as growing latency, most
+ * pronounced for whichever end of the table the router searches last.
+ */
+static int run_scale(int sock, unsigned int node_count, unsigned int tun_count)
+{
+	struct histogram *probes;
+	struct histogram *hello;
+	uint64_t hello_total = 0;
+	uint64_t base_p50 = 0;
+	uint64_t last_p50 = 0;
+	unsigned int checkpoint;
+	unsigned int idx;
+	char name[64];
+	uint64_t ns;
+	int i;
+	int j;
+	int k;
+
+	scale_count = node_count;
+	scale_tuns = tun_count;
+
+	scale_pool = qrtr_pool_shared();
+	if (!scale_pool)
+		err(1, "failed to allocate receive buffers");
+
+	scale_fds = calloc(tun_count, sizeof(*scale_fds));
+	scale_nodes = calloc(node_count, sizeof(*scale_nodes));
+	hello = malloc(sizeof(*hello));
+	probes = calloc(PROBE_COUNT, sizeof(*probes));
+	if (!scale_fds || !scale_nodes || !hello || !probes)
+		err(1, "failed to allocate nodes");
+
+	for (i = 0; i < tun_count; i++) {
+		scale_fds[i] = qrtr_tun_open();
+		if (scale_fds[i] < 0)
+			err(1, "failed to open qrtr-tun");
+	}
+
+	for (i = 0; i < node_count; i++)
+		scale_nodes[i] = qrtr_node_new(qrtr_test_node(i), scale_fds[i % tun_count]);
+
+	printf("%u nodes on %u endpoints, %u probes per point\n", node_count, tun_count, SCALE_PROBES);
+	printf("hello: HELLO round trip, dlv: ping delivery from sendto() to the endpoint, in us\n");
+	printf("%8s %10s %10s %10s %10s %10s %10s\n", "nodes", "hello p50", "hello p99",
+	       "first dlv", "last dlv", "random dlv", "random p99");
+
+	srand(1);
+
+	checkpoint = MIN(SCALE_FIRST, node_count);
+	hist_init(hello);
+
+	for (i = 0; i < node_count; i++) {
+		ns = scale_hello(i);
+
+		hist_record(hello, ns);
+		hello_total += ns;
+
+		if (i + 1 != checkpoint)
+			continue;
+
+		for (j = 0; j < PROBE_COUNT; j++)
+			hist_init(&probes[j]);
+
+		/* Interleave the probes, so they all see the same conditions */
+		for (k = 0; k < SCALE_PROBES; k++) {
+			for (j = 0; j < PROBE_COUNT; j++) {
+				if (j == PROBE_FIRST)
+					idx = 0;
+				else if (j == PROBE_LAST)
+					idx = i;
+				else
+					idx = rand() % (i + 1);
+
+				hist_record(&probes[j], scale_deliver(sock, idx));
+			}
+		}
+
+		printf("%8u %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", checkpoint,
+		       hist_percentile(hello, 50) / 1e3,
+		       hist_percentile(hello, 99) / 1e3,
+		       hist_percentile(&probes[PROBE_FIRST], 50) / 1e3,
+		       hist_percentile(&probes[PROBE_LAST], 50) / 1e3,
+		       hist_percentile(&probes[PROBE_RANDOM], 50) / 1e3,
+		       hist_percentile(&probes[PROBE_RANDOM], 99) / 1e3);
+		fflush(stdout);
+
+		snprintf(name, sizeof(name), "scale.%u.hello_p50_ns", checkpoint);
+		metric_gauge(name, hist_percentile(hello, 50));
+		for (j = 0; j < PROBE_COUNT; j++) {
+			snprintf(name, sizeof(name), "scale.%u.%s_delivery_p50_ns", checkpoint, probe_names[j]);
+			metric_gauge(name, hist_percentile(&probes[j], 50));
+		}
+
+		last_p50 = hist_percentile(&probes[PROBE_RANDOM], 50);
+		if (!base_p50)
+			base_p50 = last_p50;
+
+		/* Each row covers the HELLOs since the previous one */
+		hist_init(hello);
+		checkpoint = MIN(checkpoint * 2, node_count);
+	}
+
+	printf("registered %u nodes in %.1f ms, %.0f hellos/s\n", node_count,
+	       hello_total / 1e6, node_count * 1e9 / hello_total);
+	if (base_p50)
+		printf("random delivery p50 %.2fx from %u to %u nodes\n",
+		       (double)last_p50 / base_p50, MIN(SCALE_FIRST, node_count), node_count);
+
+	metric_gauge("scale.hello_total_ns", hello_total);
+	metric_gauge("scale.lookup_growth", base_p50 ? (double)last_p50 / base_p50 : 0.0);
+
+	free(probes);
+	free(hello);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-multi-remote [-n nodes] [-t tuns]\n");
+	exit(1);
 }
 
 int main(int argc, char **argv)
 {
 	struct qrtr_node *nodes[2];
-	struct qrtr_hdr_v1 hdr;
+	struct qrtr_pkt *pkt;
 	struct timeval tv;
-	struct iovec iov[2];
+	unsigned int node_count = 0;
+	unsigned int tun_count = 1;
 	fd_set rset;
 	int tun_fd;
 	ssize_t n;
-	char buf[8192];
 	int sock;
+	int opt;
 	int step = STEP_SEND_HELLO_1;
 
-	sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			node_count = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tun_count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!tun_count)
+		usage();
+
+	sock = qrtr_socket();
 	if (sock < 0)
 		err(1, "creating AF_QIPCRTR socket failed");
 
-	tun_fd = open("/dev/qrtr-tun", O_RDWR);
+	if (node_count)
+		return run_scale(sock, node_count, tun_count);
+
+	tun_fd = qrtr_tun_open();
 	if (tun_fd < 0)
 		err(1, "failed to open qrtr-tun");
 
-	nodes[0] = qrtr_node_new(100, tun_fd);
-	nodes[1] = qrtr_node_new(101, tun_fd);
-
-	iov[0].iov_base = &hdr;
-	iov[0].iov_len = sizeof(hdr);
-
-	iov[1].iov_base = buf;
-	iov[1].iov_len = sizeof(buf);
+	nodes[0] = qrtr_node_new(qrtr_test_node(0), tun_fd);
+	nodes[1] = qrtr_node_new(qrtr_test_node(1), tun_fd);
 
 	while (step != STEP_DONE) {
 		FD_ZERO(&rset);
@@ -147,11 +408,11 @@ int main(int argc, char **argv)
 			continue;
 		}
 
-		n = readv(tun_fd, iov, 2);
-		if (n < 0)
+		pkt = qrtr_node_recv(nodes[0]);
+		if (!pkt)
 			err(1, "failed to read");
 
-		switch (hdr.type) {
+		switch (pkt->hdr->type) {
 		case QRTR_TYPE_HELLO:
 			switch (step) {
 			case STEP_RECEIVE_HELLO_1:
@@ -167,13 +428,13 @@ int main(int argc, char **argv)
 		case QRTR_TYPE_DATA:
 			switch (step) {
 			case STEP_RECEIVE_PING_1:
-				if (hdr.dst_node_id == nodes[0]->node_id) {
+				if (pkt->hdr->dst_node_id == nodes[0]->node_id) {
 					pass("received ping 1");
 					step++;
 				}
 				break;
 			case STEP_RECEIVE_PING_2:
-				if (hdr.dst_node_id == nodes[1]->node_id) {
+				if (pkt->hdr->dst_node_id == nodes[1]->node_id) {
 					pass("received ping 2");
 					step++;
 				}
@@ -181,6 +442,8 @@ int main(int argc, char **argv)
 			}
 			break;
 		}
+
+		qrtr_pkt_put(pkt);
 	}
 
 	return !!test_fails;
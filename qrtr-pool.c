@@ -0,0 +1,221 @@
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "qrtr-pool.h"
+#include "util.h"
+
+/*
+ * Pool of fixed size receive buffers.
+ *
+ * All slabs are carved out of one arena, backed by explicit huge pages when
+ * some are reserved and otherwise by transparent huge pages where available,
+ * to keep TLB pressure down when many packets are held at once. Each slab is
+ * handed out as a reference counted struct qrtr_pkt, so a packet can be
+ * queued, forwarded or inspected after the read returns without copying it.
+ * The last qrtr_pkt_put() returns the slab to the pool.
+ *
+ * The pool is not thread safe, use one pool per thread.
+ */
+
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+struct qrtr_pool {
+	void *arena;
+	size_t arena_len;
+
+	size_t slab_size;
+	unsigned int count;
+
+	struct qrtr_pkt *pkts;
+	struct qrtr_pkt *free;
+};
+
+static struct qrtr_pool *shared_pool;
+
+static void *arena_alloc(size_t *len)
+{
+	size_t huge_len = (*len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	void *arena;
+
+	arena = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED) {
+		*len = huge_len;
+		return arena;
+	}
+
+	arena = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED)
+		return NULL;
+
+	madvise(arena, *len, MADV_HUGEPAGE);
+
+	return arena;
+}
+
+struct qrtr_pool *qrtr_pool_new(unsigned int count, size_t slab_size)
+{
+	struct qrtr_pool *pool;
+	struct qrtr_pkt *pkt;
+	unsigned int i;
+
+	if (!count || slab_size < sizeof(struct qrtr_hdr_v1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	/* Keep slabs cache line aligned */
+	pool->slab_size = (slab_size + 63) & ~(size_t)63;
+	pool->count = count;
+
+	pool->pkts = calloc(count, sizeof(*pool->pkts));
+	if (!pool->pkts)
+		goto err;
+
+	pool->arena_len = count * pool->slab_size;
+	pool->arena = arena_alloc(&pool->arena_len);
+	if (!pool->arena)
+		goto err;
+
+	for (i = count; i-- > 0;) {
+		pkt = &pool->pkts[i];
+
+		pkt->pool = pool;
+		pkt->buf = (char *)pool->arena + i * pool->slab_size;
+		pkt->next = pool->free;
+		pool->free = pkt;
+	}
+
+	return pool;
+
+err:
+	free(pool->pkts);
+	free(pool);
+	return NULL;
+}
+
+void qrtr_pool_free(struct qrtr_pool *pool)
+{
+	if (!pool)
+		return;
+
+	if (pool == shared_pool)
+		shared_pool = NULL;
+
+	munmap(pool->arena, pool->arena_len);
+	free(pool->pkts);
+	free(pool);
+}
+
+/* Pool used by the receive helpers of qrtr-test.c, created on first use */
+struct qrtr_pool *qrtr_pool_shared(void)
+{
+	if (!shared_pool)
+		shared_pool = qrtr_pool_new(QRTR_POOL_SHARED_SLABS, QRTR_POOL_SLAB_SIZE);
+
+	return shared_pool;
+}
+
+size_t qrtr_pool_slab_size(struct qrtr_pool *pool)
+{
+	return pool->slab_size;
+}
+
+struct qrtr_pkt *qrtr_pkt_alloc(struct qrtr_pool *pool)
+{
+	struct qrtr_pkt *pkt;
+
+	pkt = pool->free;
+	if (!pkt) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	pool->free = pkt->next;
+
+	pkt->next = NULL;
+	pkt->refcount = 1;
+	pkt->hdr = NULL;
+	pkt->data = NULL;
+	pkt->len = 0;
+
+	return pkt;
+}
+
+struct qrtr_pkt *qrtr_pkt_get(struct qrtr_pkt *pkt)
+{
+	pkt->refcount++;
+
+	return pkt;
+}
+
+void qrtr_pkt_put(struct qrtr_pkt *pkt)
+{
+	struct qrtr_pool *pool = pkt->pool;
+
+	if (--pkt->refcount)
+		return;
+
+	pkt->next = pool->free;
+	pool->free = pkt;
+}
+
+/*
+ * Validate the len bytes in the slab as a packet and set up the header and
+ * payload pointers. Returns -1 with errno set to EMSGSIZE if the payload was
+ * truncated, or EIO if there's no complete header.
+ */
+int qrtr_pkt_parse(struct qrtr_pkt *pkt, size_t len)
+{
+	struct qrtr_hdr_v1 *hdr = pkt->buf;
+
+	if (len < sizeof(*hdr)) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (hdr->size > len - sizeof(*hdr)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pkt->hdr = hdr;
+	pkt->data = hdr + 1;
+	pkt->len = hdr->size;
+
+	return 0;
+}
+
+/*
+ * Read one packet from the qrtr-tun fd into a slab of the pool. Returns NULL
+ * with errno set on failure, including when the packet didn't fit the slab.
+ */
+struct qrtr_pkt *qrtr_pkt_read(struct qrtr_pool *pool, int fd)
+{
+	struct qrtr_pkt *pkt;
+	int saved_errno;
+	ssize_t n;
+
+	pkt = qrtr_pkt_alloc(pool);
+	if (!pkt)
+		return NULL;
+
+	n = read(fd, pkt->buf, pool->slab_size);
+	if (n >= 0 && qrtr_pkt_parse(pkt, n) == 0)
+		return pkt;
+
+	saved_errno = errno;
+	qrtr_pkt_put(pkt);
+	errno = saved_errno;
+
+	return NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef __QRTR_POOL_H__
+#define __QRTR_POOL_H__
+
+#include <sys/types.h>
+
+#include "qrtr-test.h"
+
+/*
+ * Default slab size, fitting any packet a qrtr-tun endpoint will produce: the
+ * kernel's v1 header followed by the largest socket payload, padded to 4
+ * bytes. And the number of slabs in the pool shared by the receive helpers.
+ */
+#define QRTR_POOL_SLAB_SIZE	(sizeof(struct qrtr_hdr_v1) + ((QRTR_MAX_PAYLOAD + 3) & ~3))
+#define QRTR_POOL_SHARED_SLABS	64
+
+struct qrtr_pool;
+
+struct qrtr_pkt {
+	struct qrtr_pool *pool;
+
+	/* Free list link while in the pool, free for the owner's use otherwise */
+	struct qrtr_pkt *next;
+
+	unsigned int refcount;
+
+	void *buf;
+
+	struct qrtr_hdr_v1 *hdr;
+	void *data;
+	size_t len;
+};
+
+struct qrtr_pool *qrtr_pool_new(unsigned int count, size_t slab_size);
+void qrtr_pool_free(struct qrtr_pool *pool);
+struct qrtr_pool *qrtr_pool_shared(void);
+size_t qrtr_pool_slab_size(struct qrtr_pool *pool);
+
+struct qrtr_pkt *qrtr_pkt_alloc(struct qrtr_pool *pool);
+struct qrtr_pkt *qrtr_pkt_get(struct qrtr_pkt *pkt);
+void qrtr_pkt_put(struct qrtr_pkt *pkt);
+
+int qrtr_pkt_parse(struct qrtr_pkt *pkt, size_t len);
+struct qrtr_pkt *qrtr_pkt_read(struct qrtr_pool *pool, int fd);
+
+#endif
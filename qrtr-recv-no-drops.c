@@ -2,154 +2,550 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <linux/sock_diag.h>
 #include <err.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include "qrtr.h"
 #include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "histogram.h"
 #include "util.h"
 
+/*
+ * Have a remote send to a slow local socket, honoring the flow control
+ * watermarks, and check that every message is delivered.
+ *
+ * The remote sets confirm_rx on the packet sent when L packets are
+ * outstanding and stops at H until the RESUME_TX comes back. The time from
+ * sending the confirm_rx packet until the RESUME_TX arrives is reported as a
+ * distribution.
+ *
+ * With -s a range of (H, L) pairs is swept instead, reporting throughput and
+ * RESUME_TX latency for each window; use -d 0 to take the receiver's
+ * artificial per message delay out of the picture.
+ *
+ * With -m a matrix of receive buffer sizes and receiver delays is run
+ * instead, see run_matrix(). Drops are found from gaps in the sequence
+ * numbers carried by the messages, and the kernel's own count of drops on
+ * the socket is read through SO_MEMINFO. -b sets the receive buffer size of
+ * a single run.
+ */
+
 #define TEST_SIZE	1000
 
 #define FLOW_H		10
 #define FLOW_L		5
 
-static void run_remote(struct sockaddr_qrtr local_sq)
+#define RECV_DELAY	1000
+
+#define STALL_TIMEOUT	100
+#define DRAIN_TIMEOUT	100
+
+struct remote_result {
+	uint64_t transmitted;
+	uint64_t stalls;
+	uint64_t blocked_ns;
+	struct histogram resume;
+};
+
+struct window_result {
+	unsigned int flow_h;
+	unsigned int flow_l;
+
+	uint64_t received;
+	double rate;
+
+	uint64_t resume_p50;
+	uint64_t resume_p99;
+
+	int rcvbuf;
+	uint64_t dropped;
+	uint64_t kernel_drops;
+	uint64_t stalls;
+	uint64_t blocked_ns;
+	uint64_t elapsed_ns;
+};
+
+static const unsigned int sweep_h[] = { 2, 4, 8, 10, 16, 32, 64 };
+
+static const int matrix_rcvbuf[] = { 0, 2048, 4096, 8192, 16384, 65536 };
+static const unsigned int matrix_delay[] = { 0, 10, 100, 1000 };
+
+static unsigned int test_size = TEST_SIZE;
+static unsigned int recv_delay = RECV_DELAY;
+static unsigned int stall_timeout;
+static int rcvbuf;
+
+/*
+ * Wait for the RESUME_TX, for up to stall_timeout ms if set; returns false if
+ * it didn't come, at which point the remote carries on as if it had.
+ */
+static bool wait_resume(struct qrtr_node *node, struct remote_result *res,
+			uint64_t confirm_sent)
+{
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd;
+	uint64_t start = time_ns();
+	bool resumed = false;
+	int type;
+	int ret;
+
+	pfd.fd = node->fd;
+	pfd.events = POLLIN;
+
+	while (!resumed) {
+		ret = poll(&pfd, 1, stall_timeout ? stall_timeout : 5000);
+		if (ret < 0)
+			err(1, "[remote] poll failed");
+		if (!ret && !stall_timeout)
+			errx(1, "[remote] no resume tx received");
+		if (!ret)
+			break;
+
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
+			err(1, "[remote] failed to read");
+
+		type = pkt->hdr->type;
+		qrtr_pkt_put(pkt);
+
+		if (type == QRTR_TYPE_RESUME_TX)
+			resumed = true;
+	}
+
+	if (resumed && confirm_sent)
+		hist_record(&res->resume, time_ns() - confirm_sent);
+	if (!resumed)
+		res->stalls++;
+
+	res->blocked_ns += time_ns() - start;
+
+	return resumed;
+}
+
+static void run_remote(struct sockaddr_qrtr local_sq, unsigned int flow_h,
+		       unsigned int flow_l, int ctl_fd, int res_fd)
 {
-	struct qrtr_hdr_v1 hdr;
+	struct remote_result *res;
 	struct qrtr_node *node;
-	unsigned transmitted = 0;
-	struct timeval tv;
-	struct iovec iov[2];
-	fd_set rset;
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd;
+	uint64_t confirm_sent = 0;
+	uint32_t seq;
+	char buf[1];
 	ssize_t n;
 	int tun_fd;
-	char buf[8192];
 	int count = 0;
 
-	tun_fd = open("/dev/qrtr-tun", O_RDWR);
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		err(1, "[remote] failed to allocate result");
+
+	hist_init(&res->resume);
+
+	tun_fd = qrtr_tun_open();
 	if (tun_fd < 0)
 		err(1, "failed to open qrtr-tun");
 
-	node = qrtr_node_new(100, tun_fd);
+	node = qrtr_node_new(qrtr_test_node(0), tun_fd);
 
 	qrtr_node_hello(node);
 
-	printf("[remote] test socket at %d:%d\n", local_sq.sq_node, local_sq.sq_port);
+	pfd.fd = tun_fd;
+	pfd.events = POLLIN;
 
-	iov[0].iov_base = &hdr;
-	iov[0].iov_len = sizeof(hdr);
+	while (res->transmitted < test_size) {
+		if (count >= flow_h) {
+			wait_resume(node, res, confirm_sent);
+			confirm_sent = 0;
+			count = 0;
+			continue;
+		}
 
-	iov[1].iov_base = buf;
-	iov[1].iov_len = sizeof(buf);
+		/* Pick up an early RESUME_TX, or anything else sent our way */
+		if (poll(&pfd, 1, 0) > 0) {
+			pkt = qrtr_node_recv(node);
+			if (!pkt)
+				err(1, "[remote] failed to read");
+
+			if (pkt->hdr->type == QRTR_TYPE_RESUME_TX) {
+				if (confirm_sent)
+					hist_record(&res->resume, time_ns() - confirm_sent);
 
-	for (;;) {
-		const char ping[] = "ping";
-		FD_ZERO(&rset);
-		FD_SET(tun_fd, &rset);
+				confirm_sent = 0;
+				count = 0;
+			}
 
-		if (count >= FLOW_H || transmitted == TEST_SIZE) {
-			tv.tv_sec = 5;
-			tv.tv_usec = 0;
-		} else {
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
+			qrtr_pkt_put(pkt);
+			continue;
 		}
 
-		n = select(tun_fd + 1, &rset, NULL, NULL, &tv);
+		/* Sequence numbers let the receiver tell drops apart */
+		seq = res->transmitted;
+		n = send_data(node, 1000, &local_sq, &seq, sizeof(seq), count == flow_l);
 		if (n < 0)
-			err(1, "[remote] select failed");
+			warn("[remote] send data failed\n");
 
-		if (!n && transmitted == TEST_SIZE)
-			break;
+		if (count == flow_l)
+			confirm_sent = time_ns();
 
-		if (!n && count >= FLOW_H)
-			err(1, "[remote] no resume tx received");
+		res->transmitted++;
+		count++;
+	}
 
-		if (FD_ISSET(tun_fd, &rset)) {
-			n = readv(tun_fd, iov, 2);
-			if (n < (int)sizeof(hdr))
-				err(1, "[remote] failed to read");
+	metric_count("sent", res->transmitted);
+	hist_merge(metric_hist("resume_tx_latency", "ns"), &res->resume);
 
-			if (hdr.type == QRTR_TYPE_RESUME_TX)
-				count = 0;
-		} else {
-			n = send_data(node, 1000, &local_sq, ping, 4, count == FLOW_L);
-			if (n < 0)
-				warn("[remote] send data failed\n");
+	n = write(res_fd, res, sizeof(*res));
+	if (n != sizeof(*res))
+		err(1, "[remote] failed to report result");
 
-			transmitted++;
-			count++;
-		}
-	}
+	/* Stay around until the receiver is done with the queued messages */
+	while (read(ctl_fd, buf, sizeof(buf)) > 0)
+		;
+}
 
-	printf("[remote] sent %d\n", transmitted);
+static uint64_t socket_drops(int sock)
+{
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0)
+		return 0;
+
+	return meminfo[SK_MEMINFO_DROPS];
 }
 
-int main(int argc, char **argv)
+static int run_window(unsigned int flow_h, unsigned int flow_l,
+		      struct window_result *result, bool verbose)
 {
+	struct remote_result *res;
 	struct sockaddr_qrtr sq;
-	socklen_t sl = sizeof(sq);
 	unsigned received = 0;
-	struct pollfd pfd;
+	struct pollfd pfd[2];
+	socklen_t optlen;
+	bool remote_done = false;
+	uint32_t expected = 0;
+	uint64_t dropped = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	uint32_t seq;
 	char buf[128];
+	size_t off;
 	ssize_t n;
+	int ctl[2];
+	int rpt[2];
 	int sock;
 	int ret;
 
-	sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	sock = qrtr_socket();
 	if (sock < 0)
 		err(1, "creating AF_QIPCRTR socket failed");
 
+	if (rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		err(1, "failed to set receive buffer size");
+
+	/* Report what the kernel actually granted, it doubles the request */
+	optlen = sizeof(result->rcvbuf);
+	if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &result->rcvbuf, &optlen) < 0)
+		result->rcvbuf = 0;
+
 	sq.sq_family = AF_QIPCRTR;
 	sq.sq_node = 1;
 	sq.sq_port = 0;
-	ret = bind(sock, (void *)&sq, sizeof(sq));
+	ret = qrtr_bind(sock, &sq);
 	if (ret < 0)
 		err(1, "bind failed");
 
-	ret = getsockname(sock, (void *)&sq, &sl);
+	ret = qrtr_getsockname(sock, &sq);
 	if (ret < 0)
 		err(1, "getsockname failed");
 
+	if (verbose)
+		printf("[remote] test socket at %d:%d\n", sq.sq_node, sq.sq_port);
+
+	if (pipe(ctl) < 0 || pipe(rpt) < 0)
+		err(1, "failed to create pipes");
+
+	fflush(stdout);
+
+	start = time_ns();
+
 	ret = fork();
 	if (ret < 0)
 		err(1, "fork failed");
 
 	if (!ret) {
-		close(sock);
-		run_remote(sq);
+		qrtr_close(sock);
+		close(ctl[1]);
+		close(rpt[0]);
+		run_remote(sq, flow_h, flow_l, ctl[0], rpt[1]);
 		exit(0);
 	}
 
-	for (;;) {
-		pfd.fd = sock;
-		pfd.revents = 0;
-		pfd.events = POLLIN | POLLERR;
+	close(ctl[0]);
+	close(rpt[1]);
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN | POLLERR;
+	pfd[1].fd = rpt[0];
+	pfd[1].events = POLLIN;
 
-		ret = poll(&pfd, 1, 1000);
+	/*
+	 * Once the remote reports that it has sent everything, what's still
+	 * queued is drained; anything not arriving by then was dropped.
+	 */
+	while (received < test_size) {
+		ret = poll(pfd, 2, remote_done ? DRAIN_TIMEOUT : 5000);
 		if (ret < 0)
 			err(1, "poll failed");
 		if (!ret)
 			break;
 
-		sl = sizeof(sq);
-		n = recvfrom(sock, buf, sizeof(buf), 0, (void *)&sq, &sl);
-		if (n < 0)
+		if (pfd[1].revents) {
+			remote_done = true;
+			pfd[1].fd = -1;
+		}
+
+		if (!pfd[0].revents)
+			continue;
+
+		n = qrtr_recvfrom(sock, buf, sizeof(buf), 0, &sq);
+		if (n < 0) {
 			warn("failed receive message");
+			continue;
+		}
+
+		if (n >= sizeof(seq)) {
+			memcpy(&seq, buf, sizeof(seq));
+			if (seq > expected)
+				dropped += seq - expected;
+			expected = seq + 1;
+		}
 
 		received++;
-		usleep(1000);
+		if (recv_delay)
+			usleep(recv_delay);
+	}
+
+	elapsed = time_ns() - start;
+
+	result->kernel_drops = socket_drops(sock);
+
+	close(ctl[1]);
+	qrtr_close(sock);
+
+	res = malloc(sizeof(*res));
+	if (!res)
+		err(1, "failed to allocate result");
+
+	/* The histogram exceeds what a pipe passes in one go */
+	for (off = 0; off < sizeof(*res); off += n) {
+		n = read(rpt[0], (char *)res + off, sizeof(*res) - off);
+		if (n <= 0)
+			errx(1, "remote failed to report result");
 	}
 
+	close(rpt[0]);
 	wait(NULL);
 
-	printf("received %d of %d messages\n", received, TEST_SIZE);
+	/* Drops at the tail show up only as a shortfall */
+	dropped += res->transmitted - MIN(res->transmitted, expected);
+
+	metric_count("received", received);
+	metric_count("dropped", dropped);
+
+	if (verbose) {
+		printf("[remote] sent %llu\n", (unsigned long long)res->transmitted);
+		printf("received %d of %d messages\n", received, test_size);
+		printf("resume tx latency, H %u L %u\n", flow_h, flow_l);
+		hist_print(&res->resume, "ns");
+	}
+
+	result->flow_h = flow_h;
+	result->flow_l = flow_l;
+	result->received = received;
+	result->rate = received * 1e9 / elapsed;
+	result->resume_p50 = hist_percentile(&res->resume, 50);
+	result->resume_p99 = hist_percentile(&res->resume, 99);
+	result->dropped = dropped;
+	result->stalls = res->stalls;
+	result->blocked_ns = res->blocked_ns;
+	result->elapsed_ns = elapsed;
+
+	free(res);
+
+	return received == test_size ? 0 : 1;
+}
+
+static int run_sweep(void)
+{
+	struct window_result results[3 * ARRAY_SIZE(sweep_h)];
+	struct window_result *r;
+	unsigned int count = 0;
+	unsigned int flow_h;
+	unsigned int flow_l;
+	unsigned int last;
+	double peak = 0;
+	char bar[41];
+	char name[64];
+	int result = 0;
+	int len;
+	int i;
+	int j;
+
+	/* Low watermarks at a quarter, half and three quarters of each H */
+	for (i = 0; i < ARRAY_SIZE(sweep_h); i++) {
+		flow_h = sweep_h[i];
+		last = 0;
+
+		for (j = 1; j <= 3; j++) {
+			flow_l = MAX(flow_h * j / 4, 1);
+			if (flow_l == last || flow_l >= flow_h)
+				continue;
+
+			r = &results[count++];
+			result |= run_window(flow_h, flow_l, r, false);
+			peak = MAX(peak, r->rate);
+			last = flow_l;
+
+			snprintf(name, sizeof(name), "window.%u.%u.msgs_per_s", flow_h, flow_l);
+			metric_gauge(name, r->rate);
+		}
+	}
+
+	printf("%4s %4s %10s %12s %12s\n", "H", "L", "msgs/s", "resume p50", "resume p99");
+
+	for (i = 0; i < count; i++) {
+		r = &results[i];
+
+		len = peak ? r->rate * (sizeof(bar) - 1) / peak : 0;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+
+		printf("%4u %4u %10.0f %12llu %12llu %s\n", r->flow_h, r->flow_l, r->rate,
+		       (unsigned long long)r->resume_p50,
+		       (unsigned long long)r->resume_p99, bar);
+	}
+
+	return result;
+}
+
+/*
+ * Characterize a slow consumer: for each receive buffer size and per message
+ * delay, report how many messages were delivered and dropped, and how long
+ * the remote spent blocked on flow control. A dropped confirm_rx packet
+ * leaves the remote waiting for a RESUME_TX that never comes, which is
+ * counted as a stall and resolved after the -T timeout.
+ */
+static int run_matrix(unsigned int flow_h, unsigned int flow_l)
+{
+	struct window_result r;
+	char name[64];
+	int i;
+	int j;
+
+	if (!stall_timeout)
+		stall_timeout = STALL_TIMEOUT;
+
+	printf("%8s %8s %10s %10s %8s %8s %7s %10s %8s\n", "rcvbuf", "delay us",
+	       "msgs/s", "delivered", "dropped", "kdrops", "stalls", "blocked ms", "blocked");
+
+	for (i = 0; i < ARRAY_SIZE(matrix_rcvbuf); i++) {
+		for (j = 0; j < ARRAY_SIZE(matrix_delay); j++) {
+			rcvbuf = matrix_rcvbuf[i];
+			recv_delay = matrix_delay[j];
+
+			memset(&r, 0, sizeof(r));
+			run_window(flow_h, flow_l, &r, false);
+
+			printf("%8d %8u %10.0f %10llu %8llu %8llu %7llu %10.1f %7.1f%%\n",
+			       r.rcvbuf, recv_delay, r.rate,
+			       (unsigned long long)r.received,
+			       (unsigned long long)r.dropped,
+			       (unsigned long long)r.kernel_drops,
+			       (unsigned long long)r.stalls,
+			       r.blocked_ns / 1e6,
+			       r.elapsed_ns ? 100.0 * r.blocked_ns / r.elapsed_ns : 0.0);
+			fflush(stdout);
+
+			snprintf(name, sizeof(name), "rcvbuf.%d.delay.%u.delivered", r.rcvbuf, recv_delay);
+			metric_gauge(name, r.received);
+			snprintf(name, sizeof(name), "rcvbuf.%d.delay.%u.dropped", r.rcvbuf, recv_delay);
+			metric_gauge(name, r.dropped);
+			snprintf(name, sizeof(name), "rcvbuf.%d.delay.%u.blocked_ms", r.rcvbuf, recv_delay);
+			metric_gauge(name, r.blocked_ns / 1e6);
+		}
+	}
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-recv-no-drops [-H high] [-L low] [-c count] [-d delay-us] [-b rcvbuf] [-T stall-ms] [-s | -m]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct window_result result;
+	unsigned int flow_h = FLOW_H;
+	unsigned int flow_l = FLOW_L;
+	bool matrix = false;
+	bool sweep = false;
+	int opt;
+
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "b:c:d:H:L:msT:")) != -1) {
+		switch (opt) {
+		case 'b':
+			rcvbuf = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			test_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			recv_delay = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			flow_h = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			flow_l = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			matrix = true;
+			break;
+		case 's':
+			sweep = true;
+			break;
+		case 'T':
+			stall_timeout = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!test_size || flow_l >= flow_h)
+		usage();
+
+	if (sweep)
+		return run_sweep();
+
+	if (matrix)
+		return run_matrix(flow_h, flow_l);
 
-	return received == TEST_SIZE ? 0 : 1;
+	return run_window(flow_h, flow_l, &result, true);
 }
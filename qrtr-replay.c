@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-capture.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "util.h"
+
+/*
+ * Replay recorded QRTR traffic through emulated remote nodes.
+ *
+ * The capture is a pcapng file as written by qrtr-capture.c, or a classic
+ * pcap file, holding packets that start with the v1 header. The packets that
+ * were sent by remote nodes - those marked outbound, or lacking a direction
+ * and not originating from the recorded local node - are injected again from
+ * one emulated node per recorded source node, spread over a number of
+ * qrtr-tun endpoints. Recorded RESUME_TX packets are dropped, as confirm_rx
+ * packets from the local side are instead answered live.
+ *
+ * Packets addressed to the recorded local node are redirected to this node,
+ * where a socket is bound to each such port to consume them.
+ *
+ * Packets are sent at the recorded pace, a given multiple of it, or as fast
+ * as possible.
+ */
+
+#define MAX_SINKS		1024
+
+#define ASAP_BURST		64
+#define DRAIN_TIMEOUT		100
+
+struct record {
+	uint64_t ts;
+	const struct qrtr_hdr_v1 *hdr;
+	size_t len;
+
+	struct qrtr_node *node;
+};
+
+struct sink {
+	int sock;
+	unsigned int port;
+	uint64_t received;
+};
+
+static struct record *records;
+static size_t record_count;
+static size_t record_alloc;
+
+static struct qrtr_node **nodes;
+static unsigned int node_count;
+
+static struct sink sinks[MAX_SINKS];
+static unsigned int sink_count;
+
+static unsigned int recorded_local = 1;
+static unsigned int local_node;
+
+static uint64_t confirmed;
+
+static void add_record(uint64_t ts, const void *data, size_t len, int dir, void *arg)
+{
+	const struct qrtr_hdr_v1 *hdr = data;
+	struct record *rec;
+
+	if (len < sizeof(*hdr) || hdr->version != 1)
+		return;
+
+	if (dir == QRTR_CAPTURE_RX)
+		return;
+
+	if (!dir && hdr->src_node_id == recorded_local)
+		return;
+
+	if (hdr->type == QRTR_TYPE_RESUME_TX)
+		return;
+
+	if (record_count == record_alloc) {
+		record_alloc = record_alloc ? 2 * record_alloc : 1024;
+		records = realloc(records, record_alloc * sizeof(*records));
+		if (!records)
+			err(1, "failed to allocate records");
+	}
+
+	rec = &records[record_count++];
+	rec->ts = ts;
+	rec->hdr = hdr;
+	rec->len = MIN(len, sizeof(*hdr) + hdr->size);
+	rec->node = NULL;
+}
+
+static struct qrtr_node *node_get(unsigned int node_id, int *tun_fds, unsigned int tun_count)
+{
+	unsigned int i;
+
+	for (i = 0; i < node_count; i++) {
+		if (nodes[i]->node_id == node_id)
+			return nodes[i];
+	}
+
+	nodes = realloc(nodes, (node_count + 1) * sizeof(*nodes));
+	if (!nodes)
+		err(1, "failed to allocate nodes");
+
+	nodes[node_count] = qrtr_node_new(node_id, tun_fds[node_count % tun_count]);
+
+	return nodes[node_count++];
+}
+
+static void sink_add(unsigned int port)
+{
+	struct sockaddr_qrtr sq = { AF_QIPCRTR };
+	unsigned int i;
+	int sock;
+
+	for (i = 0; i < sink_count; i++) {
+		if (sinks[i].port == port)
+			return;
+	}
+
+	if (sink_count == MAX_SINKS) {
+		warnx("out of sinks, packets to port %u will be dropped", port);
+		return;
+	}
+
+	sock = qrtr_socket();
+	if (sock < 0)
+		err(1, "creating AF_QIPCRTR socket failed");
+
+	sq.sq_node = local_node;
+	sq.sq_port = port;
+	if (qrtr_bind(sock, &sq) < 0) {
+		warn("failed to bind sink to port %u", port);
+		qrtr_close(sock);
+		return;
+	}
+
+	sinks[sink_count].sock = sock;
+	sinks[sink_count].port = port;
+	sink_count++;
+}
+
+static void drain_tun(int fd)
+{
+	struct qrtr_node node = {
+		.fd = fd,
+		.version = QRTR_PROTO_VER_1,
+	};
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
+
+	pkt = qrtr_node_recv(&node);
+	if (!pkt)
+		err(1, "failed to read");
+
+	hdr = pkt->hdr;
+	if (hdr->type == QRTR_TYPE_DATA && hdr->confirm_rx) {
+		qrtr_resume_tx(&node, hdr->dst_node_id, hdr->dst_port_id,
+			       hdr->src_node_id, hdr->src_port_id);
+		confirmed++;
+	}
+
+	qrtr_pkt_put(pkt);
+}
+
+static void drain_sink(struct sink *sink)
+{
+	char buf[QRTR_POOL_SLAB_SIZE];
+
+	while (qrtr_recvfrom(sink->sock, buf, sizeof(buf), MSG_DONTWAIT, NULL) >= 0)
+		sink->received++;
+}
+
+static void send_record(struct record *rec, uint64_t *data_sent, uint64_t *ctrl_sent)
+{
+	struct qrtr_hdr_v1 hdr = *rec->hdr;
+	struct iovec iov[2];
+
+	if (hdr.dst_node_id == recorded_local)
+		hdr.dst_node_id = local_node;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+
+	iov[1].iov_base = (void *)(rec->hdr + 1);
+	iov[1].iov_len = rec->len - sizeof(hdr);
+
+	if (qrtr_node_writev(rec->node, iov, 2) < 0) {
+		warn("failed to replay packet from %d", rec->node->node_id);
+		return;
+	}
+
+	if (hdr.type == QRTR_TYPE_DATA)
+		(*data_sent)++;
+	else
+		(*ctrl_sent)++;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-replay [-x factor | -f] [-t tuns] [-L recorded-local-node] capture\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_qrtr sq;
+	struct pollfd *pfds;
+	struct timespec timeout;
+	uint64_t data_sent = 0;
+	uint64_t ctrl_sent = 0;
+	uint64_t received = 0;
+	unsigned int tun_count = 1;
+	bool asap = false;
+	double factor = 1.0;
+	uint64_t start;
+	uint64_t end = 0;
+	uint64_t elapsed;
+	uint64_t due;
+	uint64_t now;
+	uint64_t drain_until = 0;
+	unsigned int burst;
+	unsigned int nfds;
+	size_t next = 0;
+	int *tun_fds;
+	int sock;
+	int opt;
+	int ret;
+	int i;
+
+	while ((opt = getopt(argc, argv, "fL:t:x:")) != -1) {
+		switch (opt) {
+		case 'f':
+			asap = true;
+			break;
+		case 'L':
+			recorded_local = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tun_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			factor = strtod(optarg, NULL);
+			if (factor <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || !tun_count)
+		usage();
+
+	qrtr_capture_load(argv[optind], add_record, NULL);
+	if (!record_count)
+		errx(1, "no packets from remote nodes in %s", argv[optind]);
+
+	sock = qrtr_socket();
+	if (sock < 0)
+		err(1, "creating AF_QIPCRTR socket failed");
+
+	if (qrtr_getsockname(sock, &sq) < 0)
+		err(1, "getsockname failed");
+
+	local_node = sq.sq_node;
+	qrtr_close(sock);
+
+	tun_fds = calloc(tun_count, sizeof(*tun_fds));
+	if (!tun_fds)
+		err(1, "failed to allocate endpoints");
+
+	for (i = 0; i < tun_count; i++) {
+		tun_fds[i] = qrtr_tun_open();
+		if (tun_fds[i] < 0)
+			err(1, "failed to open qrtr-tun");
+	}
+
+	for (next = 0; next < record_count; next++) {
+		struct record *rec = &records[next];
+
+		rec->node = node_get(rec->hdr->src_node_id, tun_fds, tun_count);
+
+		if (rec->hdr->type == QRTR_TYPE_DATA && rec->hdr->dst_node_id == recorded_local)
+			sink_add(rec->hdr->dst_port_id);
+	}
+
+	/* Introduce each node, unless the capture starts out doing so */
+	for (i = 0; i < node_count; i++) {
+		for (next = 0; records[next].node != nodes[i]; next++)
+			;
+
+		if (records[next].hdr->type != QRTR_TYPE_HELLO)
+			qrtr_node_hello(nodes[i]);
+	}
+
+	nfds = tun_count + sink_count;
+	pfds = calloc(nfds, sizeof(*pfds));
+	if (!pfds)
+		err(1, "failed to allocate poll set");
+
+	for (i = 0; i < tun_count; i++) {
+		pfds[i].fd = tun_fds[i];
+		pfds[i].events = POLLIN;
+	}
+
+	for (i = 0; i < sink_count; i++) {
+		pfds[tun_count + i].fd = sinks[i].sock;
+		pfds[tun_count + i].events = POLLIN;
+	}
+
+	printf("replaying %zu packets from %u nodes over %u endpoints, %u sinks\n",
+	       record_count, node_count, tun_count, sink_count);
+	fflush(stdout);
+
+	start = time_ns();
+	next = 0;
+
+	for (;;) {
+		now = time_ns();
+
+		/* Send whatever is due, in bursts when going as fast as possible */
+		for (burst = 0; next < record_count; burst++) {
+			if (asap) {
+				if (burst == ASAP_BURST)
+					break;
+			} else {
+				due = start + (records[next].ts - records[0].ts) / factor;
+				if (due > now)
+					break;
+			}
+
+			send_record(&records[next++], &data_sent, &ctrl_sent);
+		}
+
+		if (next == record_count && !drain_until) {
+			end = time_ns();
+			drain_until = end + DRAIN_TIMEOUT * 1000000ull;
+		}
+
+		now = time_ns();
+		if (drain_until && now >= drain_until)
+			break;
+
+		if (drain_until)
+			due = drain_until;
+		else if (asap)
+			due = now;
+		else
+			due = start + (records[next].ts - records[0].ts) / factor;
+
+		due = due > now ? due - now : 0;
+		timeout.tv_sec = due / 1000000000;
+		timeout.tv_nsec = due % 1000000000;
+
+		ret = ppoll(pfds, nfds, &timeout, NULL);
+		if (ret < 0 && errno != EINTR)
+			err(1, "poll failed");
+
+		if (ret <= 0)
+			continue;
+
+		for (i = 0; i < tun_count; i++) {
+			if (pfds[i].revents & POLLIN)
+				drain_tun(pfds[i].fd);
+		}
+
+		for (i = 0; i < sink_count; i++) {
+			if (pfds[tun_count + i].revents & POLLIN)
+				drain_sink(&sinks[i]);
+		}
+
+		/* Anything arriving pushes the end of the drain out */
+		if (drain_until)
+			drain_until = time_ns() + DRAIN_TIMEOUT * 1000000ull;
+	}
+
+	/* The rate covers sending only, not the drain that follows */
+	elapsed = MAX(end - start, 1);
+
+	for (i = 0; i < sink_count; i++)
+		received += sinks[i].received;
+
+	metric_count("replayed_data", data_sent);
+	metric_count("replayed_control", ctrl_sent);
+	metric_count("sink_received", received);
+	metric_count("confirm_rx_answered", confirmed);
+	metric_gauge("packets_per_s", (data_sent + ctrl_sent) * 1e9 / elapsed);
+
+	printf("replayed %" PRIu64 " data and %" PRIu64 " control packets in %.3f s, %.0f packets/s\n",
+	       data_sent, ctrl_sent, elapsed / 1e9, (data_sent + ctrl_sent) * 1e9 / elapsed);
+	printf("recording spans %.3f s\n",
+	       (records[record_count - 1].ts - records[0].ts) / 1e9);
+	printf("sinks received %" PRIu64 " packets, %" PRIu64 " confirm_rx answered\n",
+	       received, confirmed);
+
+	return 0;
+}
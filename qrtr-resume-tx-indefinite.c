@@ -13,6 +13,7 @@
 
 #include "qrtr.h"
 #include "qrtr-test.h"
+#include "qrtr-metrics.h"
 #include "util.h"
 
 /*
@@ -22,9 +23,6 @@
 
 #define TEST_SIZE	100
 
-#define REMOTE_NODE	100
-#define REMOTE_PORT	100
-
 static int run_receiver(struct qrtr_node *node)
 {
 	struct pollfd pfd;
@@ -57,7 +55,7 @@ static void sigalrm_handler(int signo)
 
 static int run_transmitter(void)
 {
-	struct sockaddr_qrtr sq = { AF_QIPCRTR, REMOTE_NODE, REMOTE_PORT };
+	struct sockaddr_qrtr sq = { AF_QIPCRTR, qrtr_test_node(0), qrtr_test_port(0) };
 	const char ping[] = "ping";
 	unsigned sent = 0;
 	ssize_t n;
@@ -65,7 +63,7 @@ static int run_transmitter(void)
 	int sock;
 	int i;
 
-	sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	sock = qrtr_socket();
 	if (sock < 0)
 		err(1, "creating AF_QIPCRTR socket failed");
 
@@ -74,7 +72,7 @@ static int run_transmitter(void)
 	alarm(10);
 
 	for (i = 0; i < TEST_SIZE; i++) {
-		n = sendto(sock, ping, 4, 0, (void *)&sq, sizeof(sq));
+		n = qrtr_sendto(sock, ping, 4, 0, &sq);
 		if (n < 0 && errno == EPIPE)
 			break;
 		if (n < 0)
@@ -83,6 +81,8 @@ static int run_transmitter(void)
 		sent++;
 	}
 
+	metric_count("sent", sent);
+
 	if (i == TEST_SIZE)
 		errx(1, "sending didn't fail");
 
@@ -98,11 +98,13 @@ int main(int argc, char **argv)
 	int pid;
 	int ret;
 
-	tun_fd = open("/dev/qrtr-tun", O_RDWR);
+	argc = qrtr_test_args(argc, argv);
+
+	tun_fd = qrtr_tun_open();
 	if (tun_fd < 0)
 		err(1, "failed to open qrtr-tun");
 
-	node = qrtr_node_new(REMOTE_NODE, tun_fd);
+	node = qrtr_node_new(qrtr_test_node(0), tun_fd);
 
 	ret = qrtr_node_hello(node);
 	if (ret < 0)
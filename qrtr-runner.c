@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "util.h"
+
+/*
+ * Run a set of tests concurrently.
+ *
+ * Each test is started with --node-base and --port-base pointing at its own
+ * range, NODE_STRIDE ids apart, so that the emulated remotes of different
+ * tests never collide. The output of each test is collected and only shown,
+ * together with the exit status, when the test fails, or always with -v.
+ * Tests still running after the timeout are killed, along with anything they
+ * forked.
+ */
+
+#define NODE_STRIDE	10000
+#define TEST_TIMEOUT	60
+
+struct job {
+	const char *path;
+	const char *name;
+
+	int node_base;
+	int port_base;
+
+	pid_t pid;
+	int out_fd;
+
+	char *out;
+	size_t out_len;
+	size_t out_size;
+
+	uint64_t start;
+	uint64_t deadline;
+
+	bool timed_out;
+	bool running;
+};
+
+static unsigned timeout = TEST_TIMEOUT;
+static bool verbose;
+
+static sigset_t orig_mask;
+
+static void job_start(struct job *job)
+{
+	char node_base[16];
+	char port_base[16];
+	int pipefd[2];
+
+	if (pipe(pipefd) < 0)
+		err(1, "failed to create pipe");
+
+	snprintf(node_base, sizeof(node_base), "%d", job->node_base);
+	snprintf(port_base, sizeof(port_base), "%d", job->port_base);
+
+	job->start = time_ns();
+	job->deadline = job->start + timeout * 1000000000ull;
+
+	job->pid = fork();
+	switch (job->pid) {
+	case -1:
+		err(1, "fork failed");
+	case 0:
+		/* Own process group, so a timeout takes down the whole test */
+		setpgid(0, 0);
+		sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+
+		dup2(pipefd[1], STDOUT_FILENO);
+		dup2(pipefd[1], STDERR_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+
+		execlp(job->path, job->path,
+		       "--node-base", node_base, "--port-base", port_base, NULL);
+		err(127, "failed to execute %s", job->path);
+	}
+
+	setpgid(job->pid, job->pid);
+
+	close(pipefd[1]);
+	fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+	job->out_fd = pipefd[0];
+	job->running = true;
+}
+
+static void job_read(struct job *job)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (job->out_len == job->out_size) {
+			job->out_size = job->out_size ? 2 * job->out_size : 4096;
+			job->out = realloc(job->out, job->out_size);
+			if (!job->out)
+				err(1, "failed to allocate output buffer");
+		}
+
+		n = read(job->out_fd, job->out + job->out_len, job->out_size - job->out_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+
+		/* EOF or error, either way there's nothing more to collect */
+		if (n <= 0) {
+			close(job->out_fd);
+			job->out_fd = -1;
+			return;
+		}
+
+		job->out_len += n;
+	}
+}
+
+static bool job_finish(struct job *job, int status)
+{
+	uint64_t elapsed = time_ns() - job->start;
+	char reason[64] = "";
+	const char *line;
+	const char *end;
+	bool passed;
+
+	job->running = false;
+
+	/* Collect what's left, without waiting for any lingering children */
+	if (job->out_fd >= 0) {
+		job_read(job);
+		if (job->out_fd >= 0)
+			close(job->out_fd);
+		job->out_fd = -1;
+	}
+
+	passed = WIFEXITED(status) && !WEXITSTATUS(status);
+
+	if (job->timed_out)
+		snprintf(reason, sizeof(reason), " (timed out after %u s)", timeout);
+	else if (WIFSIGNALED(status))
+		snprintf(reason, sizeof(reason), " (killed by signal %d)", WTERMSIG(status));
+	else if (!passed)
+		snprintf(reason, sizeof(reason), " (exit status %d)", WEXITSTATUS(status));
+
+	printf("[%s] %s %.3f s%s\n", passed ? "PASS" : "FAIL", job->name,
+	       elapsed / 1e9, reason);
+
+	if (!passed || verbose) {
+		for (line = job->out; line && line < job->out + job->out_len; line = end + 1) {
+			end = memchr(line, '\n', job->out + job->out_len - line);
+			if (!end)
+				end = job->out + job->out_len;
+
+			printf("    %.*s\n", (int)(end - line), line);
+		}
+	}
+
+	fflush(stdout);
+
+	metric_count(passed ? "pass" : "fail", 1);
+	metric_time(job->name, elapsed);
+
+	free(job->out);
+	job->out = NULL;
+
+	return passed;
+}
+
+static void sigchld_handler(int signo)
+{
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-runner [-j jobs] [-n node-base] [-t timeout] [-v] test...\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = sigchld_handler };
+	struct timespec ts;
+	struct pollfd *pfds;
+	struct job **polled;
+	sigset_t mask;
+	struct job *jobs;
+	struct job *job;
+	unsigned int node_base = QRTR_TEST_NODE_BASE;
+	unsigned int max_jobs = 0;
+	unsigned int running = 0;
+	unsigned int started = 0;
+	unsigned int passed = 0;
+	unsigned int count;
+	unsigned int npfds;
+	uint64_t deadline;
+	uint64_t start;
+	uint64_t now;
+	int status;
+	pid_t pid;
+	int opt;
+	int ret;
+	int i;
+
+	while ((opt = getopt(argc, argv, "j:n:t:v")) != -1) {
+		switch (opt) {
+		case 'j':
+			max_jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			node_base = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	count = argc - optind;
+	if (!count || !node_base || !timeout)
+		usage();
+
+	if (!max_jobs || max_jobs > count)
+		max_jobs = count;
+
+	jobs = calloc(count, sizeof(*jobs));
+	pfds = calloc(count, sizeof(*pfds));
+	polled = calloc(count, sizeof(*polled));
+	if (!jobs || !pfds || !polled)
+		err(1, "failed to allocate jobs");
+
+	for (i = 0; i < count; i++) {
+		job = &jobs[i];
+
+		job->path = argv[optind + i];
+		job->name = strrchr(job->path, '/') ? strrchr(job->path, '/') + 1 : job->path;
+		job->node_base = node_base + i * NODE_STRIDE;
+		job->port_base = QRTR_TEST_PORT_BASE + i * NODE_STRIDE;
+		job->out_fd = -1;
+	}
+
+	/* SIGCHLD is only let through while polling, to interrupt it on exit */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	start = time_ns();
+
+	while (started < count || running) {
+		while (running < max_jobs && started < count) {
+			job_start(&jobs[started++]);
+			running++;
+		}
+
+		now = time_ns();
+		deadline = UINT64_MAX;
+		npfds = 0;
+
+		for (i = 0; i < started; i++) {
+			job = &jobs[i];
+			if (!job->running)
+				continue;
+
+			if (!job->timed_out && now >= job->deadline) {
+				kill(-job->pid, SIGKILL);
+				job->timed_out = true;
+			}
+
+			if (!job->timed_out)
+				deadline = MIN(deadline, job->deadline);
+
+			if (job->out_fd >= 0) {
+				pfds[npfds].fd = job->out_fd;
+				pfds[npfds].events = POLLIN;
+				polled[npfds++] = job;
+			}
+		}
+
+		deadline = deadline > now ? deadline - now : 0;
+		ts.tv_sec = MIN(deadline / 1000000000, timeout);
+		ts.tv_nsec = deadline % 1000000000;
+
+		ret = ppoll(pfds, npfds, &ts, &orig_mask);
+		if (ret < 0 && errno != EINTR)
+			err(1, "poll failed");
+
+		for (i = 0; i < npfds && ret > 0; i++) {
+			if (pfds[i].revents)
+				job_read(polled[i]);
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < started; i++) {
+				if (jobs[i].running && jobs[i].pid == pid)
+					break;
+			}
+
+			if (i == started)
+				continue;
+
+			passed += job_finish(&jobs[i], status);
+			running--;
+		}
+	}
+
+	printf("%u of %u tests passed in %.3f s\n", passed, count,
+	       (time_ns() - start) / 1e9);
+
+	return passed == count ? 0 : 1;
+}
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "util.h"
+
+/*
+ * Transmit scaling benchmark.
+ *
+ * For an increasing number of sender threads, each pinned to its own CPU and
+ * with its own AF_QIPCRTR socket, traffic is pushed for a fixed duration
+ * towards one or more emulated remotes on qrtr-tun. Each thread targets a
+ * distinct remote port, so that the threads don't share flow control state,
+ * and the threads are spread round robin across the remotes. Each remote runs
+ * in a separate process and acknowledges confirm_rx packets with RESUME_TX.
+ *
+ * The aggregate throughput relative to a single thread shows where contention
+ * in the router, rather than the number of CPUs, becomes the limit.
+ */
+
+#define REMOTE_NODE	100
+#define REMOTE_PORT	100
+
+#define MAX_PAYLOAD	8192
+#define MAX_REMOTES	64
+
+struct remote {
+	int node_id;
+
+	int pid;
+	int ctl_fd;
+	int res_fd;
+};
+
+struct remote_result {
+	uint64_t msgs;
+	uint64_t cpu_ns;
+};
+
+struct sender {
+	pthread_t thread;
+
+	unsigned int id;
+	int cpu;
+
+	int sock;
+	struct sockaddr_qrtr sq;
+
+	uint64_t msgs;
+	uint64_t cpu_ns;
+	uint64_t elapsed_ns;
+};
+
+static pthread_barrier_t start_barrier;
+
+static unsigned duration = 2;
+static size_t payload_size = 64;
+static bool pin = true;
+
+static int cpus[CPU_SETSIZE];
+static unsigned int ncpus;
+
+static void remote_main(struct qrtr_node *node, int ctl_fd, int res_fd)
+{
+	struct remote_result res = {};
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd[2];
+	bool done = false;
+	ssize_t n;
+	int ret;
+
+	pfd[0].fd = node->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctl_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		/* Once the senders are done, drain until the tun goes idle */
+		ret = poll(pfd, 2, done ? 100 : -1);
+		if (ret < 0)
+			err(1, "[remote %d] poll failed", node->node_id);
+		if (!ret)
+			break;
+
+		if (pfd[1].revents) {
+			done = true;
+			pfd[1].fd = -1;
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
+			err(1, "[remote %d] failed to read", node->node_id);
+
+		hdr = pkt->hdr;
+		if (hdr->type == QRTR_TYPE_DATA) {
+			res.msgs++;
+
+			if (hdr->confirm_rx)
+				qrtr_resume_tx(node, hdr->dst_node_id, hdr->dst_port_id, hdr->src_node_id, hdr->src_port_id);
+		}
+
+		qrtr_pkt_put(pkt);
+	}
+
+	res.cpu_ns = cpu_time_ns();
+
+	n = write(res_fd, &res, sizeof(res));
+	if (n != sizeof(res))
+		err(1, "[remote %d] failed to report result", node->node_id);
+}
+
+static void remote_start(struct remote *remote, int node_id)
+{
+	struct qrtr_node *node;
+	int ctl[2];
+	int rpt[2];
+	int tun_fd;
+
+	if (pipe(ctl) < 0 || pipe(rpt) < 0)
+		err(1, "failed to create pipes");
+
+	tun_fd = qrtr_tun_open();
+	if (tun_fd < 0)
+		err(1, "failed to open qrtr-tun");
+
+	node = qrtr_node_new(node_id, tun_fd);
+
+	if (qrtr_node_hello(node) < 0)
+		err(1, "failed to hello");
+
+	remote->node_id = node_id;
+
+	remote->pid = fork();
+	switch (remote->pid) {
+	case -1:
+		err(1, "fork failed");
+	case 0:
+		close(ctl[1]);
+		close(rpt[0]);
+		remote_main(node, ctl[0], rpt[1]);
+		exit(0);
+	}
+
+	close(tun_fd);
+	free(node);
+	close(ctl[0]);
+	close(rpt[1]);
+
+	remote->ctl_fd = ctl[1];
+	remote->res_fd = rpt[0];
+}
+
+static void remote_stop(struct remote *remote, struct remote_result *res)
+{
+	ssize_t n;
+
+	close(remote->ctl_fd);
+
+	n = read(remote->res_fd, res, sizeof(*res));
+	if (n != sizeof(*res))
+		errx(1, "remote %d failed to report result", remote->node_id);
+
+	close(remote->res_fd);
+	waitpid(remote->pid, NULL, 0);
+}
+
+static void *sender_main(void *data)
+{
+	struct sender *sender = data;
+	char payload[MAX_PAYLOAD];
+	uint64_t cpu_start;
+	uint64_t start;
+	uint64_t end;
+	uint64_t now;
+	cpu_set_t set;
+	ssize_t n;
+	int ret;
+
+	memset(payload, 0xa5, payload_size);
+
+	if (pin) {
+		CPU_ZERO(&set);
+		CPU_SET(sender->cpu, &set);
+
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret) {
+			errno = ret;
+			err(1, "failed to pin thread %u to cpu %d", sender->id, sender->cpu);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	cpu_start = thread_cpu_time_ns();
+	start = time_ns();
+	end = start + duration * 1000000000ull;
+
+	do {
+		n = qrtr_sendto(sender->sock, payload, payload_size, 0, &sender->sq);
+		if (n < 0)
+			err(1, "thread %u failed to send to %d:%d", sender->id,
+			    sender->sq.sq_node, sender->sq.sq_port);
+
+		sender->msgs++;
+		now = time_ns();
+	} while (now < end);
+
+	sender->elapsed_ns = now - start;
+	sender->cpu_ns = thread_cpu_time_ns() - cpu_start;
+
+	metric_count("sent", sender->msgs);
+
+	return NULL;
+}
+
+static double run_round(unsigned int nthreads, unsigned int nremotes, double base)
+{
+	struct remote remotes[MAX_REMOTES];
+	struct remote_result res;
+	struct sender *senders;
+	char name[64];
+	struct sender *sender;
+	uint64_t received = 0;
+	uint64_t sent = 0;
+	uint64_t cpu_ns = 0;
+	double rate = 0;
+	double min = 0;
+	double max = 0;
+	double thr;
+	unsigned int i;
+	int ret;
+
+	nremotes = MIN(nremotes, nthreads);
+
+	for (i = 0; i < nremotes; i++)
+		remote_start(&remotes[i], REMOTE_NODE + i);
+
+	senders = calloc(nthreads, sizeof(*senders));
+	if (!senders)
+		err(1, "failed to allocate senders");
+
+	ret = pthread_barrier_init(&start_barrier, NULL, nthreads);
+	if (ret) {
+		errno = ret;
+		err(1, "failed to create barrier");
+	}
+
+	/* Sockets are created up front, the loopback bookkeeping isn't thread safe */
+	for (i = 0; i < nthreads; i++) {
+		sender = &senders[i];
+
+		sender->id = i;
+		sender->cpu = cpus[i % ncpus];
+		sender->sq.sq_family = AF_QIPCRTR;
+		sender->sq.sq_node = remotes[i % nremotes].node_id;
+		sender->sq.sq_port = REMOTE_PORT + i;
+
+		sender->sock = qrtr_socket();
+		if (sender->sock < 0)
+			err(1, "creating AF_QIPCRTR socket failed");
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		ret = pthread_create(&senders[i].thread, NULL, sender_main, &senders[i]);
+		if (ret) {
+			errno = ret;
+			err(1, "failed to create thread %u", i);
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		sender = &senders[i];
+
+		pthread_join(sender->thread, NULL);
+		qrtr_close(sender->sock);
+
+		thr = sender->msgs * 1e9 / sender->elapsed_ns;
+		min = i ? MIN(min, thr) : thr;
+		max = MAX(max, thr);
+
+		rate += thr;
+		sent += sender->msgs;
+		cpu_ns += sender->cpu_ns;
+	}
+
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < nremotes; i++) {
+		remote_stop(&remotes[i], &res);
+		received += res.msgs;
+	}
+
+	if (received != sent)
+		warnx("sent %llu messages, remotes received %llu",
+		      (unsigned long long)sent, (unsigned long long)received);
+
+	snprintf(name, sizeof(name), "threads.%u.msgs_per_s", nthreads);
+	metric_gauge(name, rate);
+	snprintf(name, sizeof(name), "threads.%u.min_thread_msgs_per_s", nthreads);
+	metric_gauge(name, min);
+	snprintf(name, sizeof(name), "threads.%u.scaling", nthreads);
+	metric_gauge(name, base ? rate / base : 1.0);
+
+	printf("%7u %7u %12.0f %8.2f %10.0f %12.0f %12.0f\n",
+	       nthreads, nremotes, rate, base ? rate / base : 1.0,
+	       sent ? (double)cpu_ns / sent : 0, min, max);
+
+	for (i = 0; i < nthreads; i++) {
+		sender = &senders[i];
+
+		printf("        thread %2u cpu %2d -> %d:%d %12.0f msgs/s %8.0f cpu ns\n",
+		       sender->id, pin ? sender->cpu : -1,
+		       sender->sq.sq_node, sender->sq.sq_port,
+		       sender->msgs * 1e9 / sender->elapsed_ns,
+		       sender->msgs ? (double)sender->cpu_ns / sender->msgs : 0);
+	}
+
+	fflush(stdout);
+
+	free(senders);
+
+	return rate;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-scale [-d seconds] [-s size] [-t max-threads] [-r remotes] [-P]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max_threads = 0;
+	unsigned int nremotes = 1;
+	unsigned int n;
+	cpu_set_t set;
+	double base = 0;
+	double rate;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:Pr:s:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'P':
+			pin = false;
+			break;
+		case 'r':
+			nremotes = strtoul(optarg, NULL, 0);
+			if (!nremotes || nremotes > MAX_REMOTES)
+				errx(1, "remotes must be in range [1, %d]", MAX_REMOTES);
+			break;
+		case 's':
+			payload_size = strtoul(optarg, NULL, 0);
+			if (!payload_size || payload_size > MAX_PAYLOAD)
+				errx(1, "size must be in range [1, %d]", MAX_PAYLOAD);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!duration)
+		usage();
+
+	/* Senders are pinned to the CPUs we're allowed to run on, in order */
+	if (sched_getaffinity(0, sizeof(set), &set) < 0)
+		err(1, "failed to get cpu affinity");
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &set))
+			cpus[ncpus++] = i;
+	}
+
+	if (!max_threads)
+		max_threads = ncpus;
+
+	printf("%7s %7s %12s %8s %10s %12s %12s\n",
+	       "threads", "remotes", "msgs/s", "scaling", "cpu ns", "min thr/s", "max thr/s");
+	fflush(stdout);
+
+	for (n = 1; n <= max_threads; n++) {
+		rate = run_round(n, nremotes, base);
+		if (n == 1)
+			base = rate;
+	}
+
+	return 0;
+}
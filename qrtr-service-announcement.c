@@ -1,10 +1,12 @@
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <err.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -13,6 +15,8 @@
 
 #include "qrtr.h"
 #include "qrtr-test.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
 #include "util.h"
 
 #define BIT(x) (1 << (x))
@@ -25,18 +29,23 @@
  * Check that the N services was announced
  * Stop the remote
  * Repeat
+ *
+ * Each service is registered from its own socket. For every round the time
+ * from the remote's HELLO until the first and the last NEW_SERVER arrive is
+ * reported, together with the resulting announcement rate. Use -n to scale the
+ * number of services, e.g. to 100000; the open file limit is raised to match.
  */
 
-#define REMOTE_NODE	100
-
 #define SERVICE_COUNT	100
 #define TEST_ROUNDS	3
 
+static unsigned service_count = SERVICE_COUNT;
+static unsigned test_rounds = TEST_ROUNDS;
+
 static int register_service(int idx)
 {
 	struct sockaddr_qrtr sq;
 	struct qrtr_ctrl_pkt pkt = {};
-	socklen_t sl = sizeof(sq);
 	ssize_t n;
 	int sock;
 	int ret;
@@ -45,123 +54,218 @@ static int register_service(int idx)
 	pkt.server.service = 1337;
 	pkt.server.instance = idx + 1;
 
-	sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	sock = qrtr_socket();
 	if (sock < 0)
 		err(1, "creating AF_QIPCRTR socket failed");
 
-	ret = getsockname(sock, (void *)&sq, &sl);
+	ret = qrtr_getsockname(sock, &sq);
 	if (ret < 0)
 		err(1, "getsockname failed");
 
 	sq.sq_port = QRTR_PORT_CTRL;
 
-	n = sendto(sock, &pkt, sizeof(pkt), 0, (void *)&sq, sizeof(sq));
+	n = qrtr_sendto(sock, &pkt, sizeof(pkt), 0, &sq);
 	if (n < 0)
 		err(1, "fail to register service");
 
 	return 0;
 }
 
-static int test_announcement(void)
+static void raise_nofile_limit(unsigned needed)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		err(1, "failed to get open file limit");
+
+	if (rlim.rlim_cur >= needed)
+		return;
+
+	if (rlim.rlim_max < needed)
+		errx(1, "%u services needs %u open files, hard limit is %lu",
+		     service_count, needed, (unsigned long)rlim.rlim_max);
+
+	rlim.rlim_cur = needed;
+	if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		err(1, "failed to raise open file limit");
+}
+
+static bool mark_seen(uint32_t *seen, int instance, unsigned *duplicates)
+{
+	int bit = instance - 1;
+
+	if (bit < 0 || bit >= service_count) {
+		warnx("Unexpected instance %d announced", instance);
+		return false;
+	}
+
+	if (seen[bit / 32] & BIT(bit % 32)) {
+		warnx("Already been notified about instance %d", instance);
+		(*duplicates)++;
+		return false;
+	}
+
+	seen[bit / 32] |= BIT(bit % 32);
+
+	return true;
+}
+
+static int test_announcement(int round)
 {
 	struct qrtr_ctrl_pkt *ctrl;
-	struct qrtr_hdr_v1 hdr;
 	struct qrtr_node *node;
-	struct iovec iov[2];
-	struct timeval tv = {5, 0};
+	struct qrtr_pkt *pkt;
+	struct pollfd pfd;
+	unsigned duplicates = 0;
 	unsigned received = 0;
+	uint64_t first = 0;
+	uint64_t last = 0;
+	uint64_t start;
+	uint32_t *seen;
 	int result;
-	fd_set rset;
 	ssize_t n;
 	int tun_fd;
-	char buf[128];
 	int ret;
-	uint32_t seen[(SERVICE_COUNT + 31) / 32] = {};
-	int bit;
 	int i;
 
-	iov[0].iov_base = &hdr;
-	iov[0].iov_len = sizeof(hdr);
-
-	iov[1].iov_base = buf;
-	iov[1].iov_len = sizeof(buf);
+	seen = calloc((service_count + 31) / 32, sizeof(*seen));
+	if (!seen)
+		err(1, "failed to allocate service bitmap");
 
-	tun_fd = open("/dev/qrtr-tun", O_RDWR);
+	tun_fd = qrtr_tun_open();
 	if (tun_fd < 0)
 		err(1, "failed to open qrtr-tun");
 
-	node = qrtr_node_new(REMOTE_NODE, tun_fd);
+	node = qrtr_node_new(qrtr_test_node(0), tun_fd);
+
+	start = time_ns();
 
 	ret = qrtr_node_hello(node);
 	if (ret < 0)
 		err(1, "failed to hello");
 
-	for (;;) {
-		FD_ZERO(&rset);
-		FD_SET(tun_fd, &rset);
-
-		usleep(1000);
+	pfd.fd = tun_fd;
+	pfd.events = POLLIN;
 
-		n = select(tun_fd + 1, &rset, NULL, NULL, &tv);
+	/*
+	 * With many services registered the endpoint's descriptor ends up beyond
+	 * FD_SETSIZE, so poll() rather than select(). Once every instance has
+	 * been announced the round ends, after draining whatever is already
+	 * queued so that duplicates sent along with the last one are caught.
+	 */
+	for (;;) {
+		n = poll(&pfd, 1, received < service_count ? 5000 : 0);
 		if (n < 0)
-			err(1, "select failed");
+			err(1, "poll failed");
 		if (!n)
 			break;
 
-		if (FD_ISSET(tun_fd, &rset)) {
-			n = readv(tun_fd, iov, 2);
-			if (n < (int)sizeof(hdr))
-				err(1, "failed to read");
+		if (!(pfd.revents & POLLIN))
+			continue;
 
-			if (hdr.type != QRTR_TYPE_NEW_SERVER)
-			       continue;
+		pkt = qrtr_node_recv(node);
+		if (!pkt)
+			err(1, "failed to read");
 
-			if (n < (int)sizeof(hdr) + hdr.size)
-				errx(1, "truncated control packet");
-
-			ctrl = (struct qrtr_ctrl_pkt *)buf;
-			if (ctrl->cmd != QRTR_TYPE_NEW_SERVER)
-				err(1, "new server message is a %d message", ctrl->cmd);
-
-			if (ctrl->server.service == 1337) {
-				bit = ctrl->server.instance - 1;
+		if (pkt->hdr->type != QRTR_TYPE_NEW_SERVER) {
+			qrtr_pkt_put(pkt);
+			continue;
+		}
 
-				if (seen[bit / 32] & BIT(bit % 32))
-					warnx("Already been notified about instance %d", ctrl->server.instance);
+		if (pkt->len < sizeof(*ctrl))
+			errx(1, "truncated control packet");
 
-				seen[bit / 32] |= BIT(bit % 32);
+		ctrl = pkt->data;
+		if (ctrl->cmd != QRTR_TYPE_NEW_SERVER)
+			err(1, "new server message is a %d message", ctrl->cmd);
 
-				received++;
-			}
+		if (ctrl->server.service == 1337 &&
+		    mark_seen(seen, ctrl->server.instance, &duplicates)) {
+			last = time_ns();
+			if (!received++)
+				first = last;
 		}
+
+		qrtr_pkt_put(pkt);
 	}
 
 	close(tun_fd);
+	free(node);
+
+	warnx("received %d of %d service announcements", received, service_count);
+
+	metric_count("announcements", received);
+	metric_count("duplicates", duplicates);
 
-	warnx("received %d of %d service announcements", received, SERVICE_COUNT);
+	if (received) {
+		metric_time("first_announcement", first - start);
+		metric_time("last_announcement", last - start);
+
+		printf("round %d: first %.3f ms, last %.3f ms after hello, %.0f services/s\n",
+		       round, (first - start) / 1e6, (last - start) / 1e6,
+		       received * 1e9 / (last - start));
+	}
 
 	result = 0;
 
-	for (i = 0; i < SERVICE_COUNT; i++) {
+	for (i = 0; i < service_count; i++) {
 		if (!(seen[i / 32] & BIT(i % 32))) {
 			warnx("Expected instance %d to be announced", i + 1);
 			result = 1;
 		}
 	}
 
+	free(seen);
+
 	return result;
 }
 
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-service-announcement [-n services] [-r rounds]\n");
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
+	uint64_t start;
 	int result;
+	int opt;
 	int i;
 
-	for (i = 0; i < SERVICE_COUNT; i++)
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			service_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			test_rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!service_count)
+		usage();
+
+	/* One socket per service, plus the transport's own descriptors */
+	raise_nofile_limit(2 * service_count + 64);
+
+	start = time_ns();
+
+	for (i = 0; i < service_count; i++)
 		register_service(i);
 
-	for (i = 0; i < TEST_ROUNDS; i++) {
-		result = test_announcement();
+	metric_time("registration", time_ns() - start);
+
+	printf("registered %u services in %.3f ms\n", service_count,
+	       (time_ns() - start) / 1e6);
+
+	for (i = 0; i < test_rounds; i++) {
+		result = test_announcement(i);
 		if (result)
 			return result;
 	}
@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr.h"
+#include "qrtr-test.h"
+#include "qrtr-loop.h"
+#include "qrtr-metrics.h"
+#include "qrtr-pool.h"
+#include "util.h"
+
+/*
+ * Sender stall benchmark.
+ *
+ * A number of sockets, each driven from its own thread, send to separate
+ * ports of an emulated remote, which answers confirm_rx packets with a
+ * RESUME_TX according to a programmable policy, built from one or more -R
+ * rules:
+ *
+ *   delay:MS		every RESUME_TX is held back MS milliseconds
+ *   exp:MS		as above, but exponentially distributed with mean MS
+ *   uniform:MIN:MAX	as above, but uniformly distributed in [MIN, MAX]
+ *   stall:MS:PERIOD	the remote goes quiet for MS out of every PERIOD
+ *			milliseconds, RESUME_TX due meanwhile go out as it
+ *			wakes up, like a modem in a low power state
+ *   drop:N[:MS]	every Nth RESUME_TX is lost; as the sender would then
+ *			block forever it's instead sent MS (default 1000)
+ *			milliseconds late, as by a firmware watchdog
+ *
+ * Delays are applied on the remote's 1 ms timer wheel. The same load is first
+ * run with RESUME_TX sent right away, and for each socket the throughput lost
+ * relative to that baseline is reported, together with the time the sender
+ * spent blocked in sendto(); a send taking longer than the -b threshold is
+ * counted as a stall.
+ */
+
+#define MAX_SOCKETS	64
+#define MAX_RULES	8
+
+#define DROP_RECOVER	1000
+
+enum {
+	RULE_DELAY,
+	RULE_EXP,
+	RULE_UNIFORM,
+	RULE_STALL,
+	RULE_DROP,
+};
+
+struct rule {
+	int type;
+
+	double a;
+	double b;
+};
+
+struct pending_resume {
+	struct qrtr_timer timer;
+	struct qrtr_node *node;
+
+	struct qrtr_hdr_v1 hdr;
+};
+
+struct remote_state {
+	struct qrtr_node *node;
+
+	uint64_t start;
+	unsigned long resumes;
+};
+
+struct sender {
+	pthread_t thread;
+	unsigned int id;
+
+	int sock;
+	struct sockaddr_qrtr sq;
+
+	uint64_t msgs;
+	uint64_t elapsed_ns;
+
+	uint64_t blocked_ns;
+	uint64_t stalls;
+	uint64_t max_stall_ns;
+};
+
+static struct rule rules[MAX_RULES];
+static unsigned int rule_count;
+
+static unsigned int sock_count = 4;
+static unsigned int duration = 2;
+static unsigned int stall_threshold_us = 100;
+static size_t payload_size = 64;
+
+static pthread_barrier_t start_barrier;
+
+static void parse_rule(const char *spec)
+{
+	static const struct {
+		const char *name;
+		int type;
+		int min_args;
+	} kinds[] = {
+		{ "delay", RULE_DELAY, 1 },
+		{ "exp", RULE_EXP, 1 },
+		{ "uniform", RULE_UNIFORM, 2 },
+		{ "stall", RULE_STALL, 2 },
+		{ "drop", RULE_DROP, 1 },
+	};
+	struct rule *rule;
+	const char *arg;
+	size_t len;
+	int nargs;
+	int i;
+
+	if (rule_count == MAX_RULES)
+		errx(1, "too many rules, max %d", MAX_RULES);
+
+	arg = strchr(spec, ':');
+	if (!arg)
+		errx(1, "invalid rule \"%s\"", spec);
+
+	len = arg - spec;
+	for (i = 0; i < ARRAY_SIZE(kinds); i++) {
+		if (strlen(kinds[i].name) == len && !strncmp(spec, kinds[i].name, len))
+			break;
+	}
+
+	if (i == ARRAY_SIZE(kinds))
+		errx(1, "unknown rule \"%.*s\"", (int)len, spec);
+
+	rule = &rules[rule_count++];
+	rule->type = kinds[i].type;
+	rule->b = rule->type == RULE_DROP ? DROP_RECOVER : 0;
+
+	nargs = sscanf(arg + 1, "%lf:%lf", &rule->a, &rule->b);
+	if (nargs < kinds[i].min_args || rule->a < 0 || rule->b < 0)
+		errx(1, "invalid arguments to rule \"%s\"", spec);
+
+	if (rule->type == RULE_STALL && rule->a >= rule->b)
+		errx(1, "stall must be shorter than its period in \"%s\"", spec);
+	if (rule->type == RULE_DROP && rule->a < 1)
+		errx(1, "drop interval must be at least 1 in \"%s\"", spec);
+}
+
+/* Time, in ns after now, at which the next RESUME_TX should go out */
+static uint64_t resume_delay(struct remote_state *state, uint64_t now)
+{
+	struct rule *rule;
+	uint64_t period;
+	uint64_t stall;
+	uint64_t phase;
+	double delay_ms = 0;
+	uint64_t due;
+	int i;
+
+	state->resumes++;
+
+	for (i = 0; i < rule_count; i++) {
+		rule = &rules[i];
+
+		switch (rule->type) {
+		case RULE_DELAY:
+			delay_ms += rule->a;
+			break;
+		case RULE_EXP:
+			delay_ms += -rule->a * log(1.0 - drand48());
+			break;
+		case RULE_UNIFORM:
+			delay_ms += rule->a + (rule->b - rule->a) * drand48();
+			break;
+		case RULE_DROP:
+			if (!(state->resumes % (unsigned long)rule->a))
+				delay_ms += rule->b;
+			break;
+		}
+	}
+
+	due = now + delay_ms * 1e6;
+
+	/* Stalls are applied last, deferring whatever falls in a quiet window */
+	for (i = 0; i < rule_count; i++) {
+		rule = &rules[i];
+		if (rule->type != RULE_STALL)
+			continue;
+
+		stall = rule->a * 1e6;
+		period = rule->b * 1e6;
+		phase = (due - state->start) % period;
+		if (phase < stall)
+			due += stall - phase;
+	}
+
+	return due - now;
+}
+
+static void resume_expired(struct qrtr_loop *loop, struct qrtr_timer *timer)
+{
+	struct pending_resume *pending = container_of(timer, struct pending_resume, timer);
+	struct qrtr_hdr_v1 *hdr = &pending->hdr;
+
+	qrtr_resume_tx(pending->node, hdr->dst_node_id, hdr->dst_port_id,
+		       hdr->src_node_id, hdr->src_port_id);
+
+	free(pending);
+}
+
+static void remote_tun_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	struct remote_state *state = data;
+	struct pending_resume *pending;
+	struct qrtr_hdr_v1 *hdr;
+	struct qrtr_pkt *pkt;
+	uint64_t delay;
+
+	pkt = qrtr_node_recv(state->node);
+	if (!pkt)
+		err(1, "[remote] failed to read");
+
+	hdr = pkt->hdr;
+	if (hdr->type != QRTR_TYPE_DATA || !hdr->confirm_rx)
+		goto out;
+
+	delay = resume_delay(state, time_ns());
+	if (!delay) {
+		qrtr_resume_tx(state->node, hdr->dst_node_id, hdr->dst_port_id,
+			       hdr->src_node_id, hdr->src_port_id);
+		goto out;
+	}
+
+	pending = malloc(sizeof(*pending));
+	if (!pending)
+		err(1, "[remote] failed to allocate resume");
+
+	pending->node = state->node;
+	pending->hdr = *hdr;
+
+	/* The wheel ticks in milliseconds, round up to not undercut the policy */
+	qrtr_timer_init(&pending->timer, resume_expired);
+	qrtr_timer_arm(loop, &pending->timer, (delay + 999999) / 1000000);
+
+out:
+	qrtr_pkt_put(pkt);
+}
+
+static void remote_ctl_event(struct qrtr_loop *loop, int fd, uint32_t events, void *data)
+{
+	qrtr_loop_quit(loop);
+}
+
+static void run_remote(struct qrtr_node *node, int ctl_fd, bool apply_policy)
+{
+	struct remote_state state = {};
+	struct qrtr_loop *loop;
+	int ret;
+
+	if (!apply_policy)
+		rule_count = 0;
+
+	srand48(1);
+
+	loop = qrtr_loop_new();
+	if (!loop)
+		err(1, "[remote] failed to create event loop");
+
+	state.node = node;
+	state.start = time_ns();
+
+	ret = qrtr_loop_add_fd(loop, node->fd, EPOLLIN, remote_tun_event, &state);
+	if (ret < 0)
+		err(1, "[remote] failed to watch qrtr-tun");
+
+	ret = qrtr_loop_add_fd(loop, ctl_fd, EPOLLIN, remote_ctl_event, &state);
+	if (ret < 0)
+		err(1, "[remote] failed to watch control pipe");
+
+	if (qrtr_loop_run(loop) < 0)
+		err(1, "[remote] event loop failed");
+
+	metric_count("resumes", state.resumes);
+}
+
+static void *sender_main(void *data)
+{
+	struct sender *sender = data;
+	char payload[4096];
+	uint64_t threshold = stall_threshold_us * 1000ull;
+	uint64_t before;
+	uint64_t start;
+	uint64_t end;
+	uint64_t now;
+	uint64_t t;
+	ssize_t n;
+
+	memset(payload, 0xa5, payload_size);
+
+	pthread_barrier_wait(&start_barrier);
+
+	start = time_ns();
+	end = start + duration * 1000000000ull;
+	now = start;
+
+	do {
+		before = now;
+
+		n = qrtr_sendto(sender->sock, payload, payload_size, 0, &sender->sq);
+		if (n < 0)
+			err(1, "socket %u failed to send to %d:%d", sender->id,
+			    sender->sq.sq_node, sender->sq.sq_port);
+
+		now = time_ns();
+
+		t = now - before;
+		if (t > threshold) {
+			sender->blocked_ns += t;
+			sender->stalls++;
+			sender->max_stall_ns = MAX(sender->max_stall_ns, t);
+		}
+
+		sender->msgs++;
+	} while (now < end);
+
+	sender->elapsed_ns = now - start;
+
+	return NULL;
+}
+
+static void run_load(struct sender *senders, bool apply_policy)
+{
+	struct qrtr_node *node;
+	unsigned int i;
+	int tun_fd;
+	int ctl[2];
+	int ret;
+	int pid;
+
+	if (pipe(ctl) < 0)
+		err(1, "failed to create pipe");
+
+	tun_fd = qrtr_tun_open();
+	if (tun_fd < 0)
+		err(1, "failed to open qrtr-tun");
+
+	node = qrtr_node_new(qrtr_test_node(0), tun_fd);
+
+	if (qrtr_node_hello(node) < 0)
+		err(1, "failed to hello");
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		err(1, "fork failed");
+	case 0:
+		close(ctl[1]);
+		run_remote(node, ctl[0], apply_policy);
+		exit(0);
+	}
+
+	close(tun_fd);
+	free(node);
+	close(ctl[0]);
+
+	ret = pthread_barrier_init(&start_barrier, NULL, sock_count);
+	if (ret) {
+		errno = ret;
+		err(1, "failed to create barrier");
+	}
+
+	/* Sockets are created up front, the loopback bookkeeping isn't thread safe */
+	for (i = 0; i < sock_count; i++) {
+		memset(&senders[i], 0, sizeof(senders[i]));
+
+		senders[i].id = i;
+		senders[i].sq.sq_family = AF_QIPCRTR;
+		senders[i].sq.sq_node = qrtr_test_node(0);
+		senders[i].sq.sq_port = qrtr_test_port(i);
+
+		senders[i].sock = qrtr_socket();
+		if (senders[i].sock < 0)
+			err(1, "creating AF_QIPCRTR socket failed");
+	}
+
+	for (i = 0; i < sock_count; i++) {
+		ret = pthread_create(&senders[i].thread, NULL, sender_main, &senders[i]);
+		if (ret) {
+			errno = ret;
+			err(1, "failed to create thread %u", i);
+		}
+	}
+
+	for (i = 0; i < sock_count; i++) {
+		pthread_join(senders[i].thread, NULL);
+		qrtr_close(senders[i].sock);
+	}
+
+	pthread_barrier_destroy(&start_barrier);
+
+	close(ctl[1]);
+	waitpid(pid, NULL, 0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qrtr-stall [-d seconds] [-n sockets] [-s size] [-b stall-us] -R rule...\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sender base[MAX_SOCKETS];
+	struct sender load[MAX_SOCKETS];
+	struct sender *s;
+	double base_rate;
+	double rate;
+	char name[64];
+	int opt;
+	int i;
+
+	argc = qrtr_test_args(argc, argv);
+
+	while ((opt = getopt(argc, argv, "b:d:n:R:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			stall_threshold_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			sock_count = strtoul(optarg, NULL, 0);
+			if (!sock_count || sock_count > MAX_SOCKETS)
+				errx(1, "sockets must be in range [1, %d]", MAX_SOCKETS);
+			break;
+		case 'R':
+			parse_rule(optarg);
+			break;
+		case 's':
+			payload_size = strtoul(optarg, NULL, 0);
+			if (!payload_size || payload_size > 4096)
+				errx(1, "size must be in range [1, 4096]");
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!duration || !rule_count)
+		usage();
+
+	run_load(base, false);
+	run_load(load, true);
+
+	printf("%4s %6s %10s %10s %7s %10s %8s %8s %12s\n",
+	       "sock", "port", "base/s", "msgs/s", "loss", "blocked ms", "blocked", "stalls", "max stall us");
+
+	for (i = 0; i < sock_count; i++) {
+		s = &load[i];
+
+		base_rate = base[i].msgs * 1e9 / base[i].elapsed_ns;
+		rate = s->msgs * 1e9 / s->elapsed_ns;
+
+		printf("%4u %6d %10.0f %10.0f %6.1f%% %10.1f %7.1f%% %8llu %12.0f\n",
+		       s->id, s->sq.sq_port, base_rate, rate,
+		       base_rate ? 100.0 * (1.0 - rate / base_rate) : 0.0,
+		       s->blocked_ns / 1e6, 100.0 * s->blocked_ns / s->elapsed_ns,
+		       (unsigned long long)s->stalls, s->max_stall_ns / 1e3);
+
+		snprintf(name, sizeof(name), "sock.%u.msgs_per_s", i);
+		metric_gauge(name, rate);
+		snprintf(name, sizeof(name), "sock.%u.loss", i);
+		metric_gauge(name, base_rate ? 1.0 - rate / base_rate : 0.0);
+		snprintf(name, sizeof(name), "sock.%u.blocked_ns", i);
+		metric_gauge(name, s->blocked_ns);
+	}
+
+	return 0;
+}
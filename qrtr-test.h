@@ -1,28 +1,76 @@
 #ifndef __QRTR_TEST_H__
 #define __QRTR_TEST_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "qrtr.h"
+#include "qrtr-hdr.h"
+
+struct qrtr_capture;
+struct qrtr_pkt;
 
-struct qrtr_hdr_v1 {
-	__le32 version;
-	__le32 type;
-	__le32 src_node_id;
-	__le32 src_port_id;
-	__le32 confirm_rx;
-	__le32 size;
-	__le32 dst_node_id;
-	__le32 dst_port_id;
-} __packed;
+/* Default start of the node and port ranges used by the emulated remotes */
+#define QRTR_TEST_NODE_BASE	100
+#define QRTR_TEST_PORT_BASE	100
+
+#define QRTR_HEXDUMP_ENV	"QRTR_HEXDUMP"
 
 struct qrtr_node {
 	int node_id;
 
 	int fd;
+
+	/* Header format of packets sent by the node, QRTR_PROTO_VER_1 or _2 */
+	unsigned int version;
+
+	struct qrtr_uring *uring;
+};
+
+/* Encoded header of packets from a node port towards one destination */
+struct qrtr_tx_template {
+	unsigned int version;
+	size_t hdr_len;
+
+	union {
+		struct qrtr_hdr_v1 v1;
+		char buf[QRTR_HDR_MAX_LEN];
+	} hdr;
 };
 
+struct qrtr_tx_desc {
+	struct qrtr_tx_template *tmpl;
+
+	const void *data;
+	size_t len;
+
+	int confirm_rx;
+};
+
+int qrtr_test_args(int argc, char **argv);
+int qrtr_test_node(int idx);
+int qrtr_test_port(int idx);
+
+int qrtr_tun_open(void);
+
+int qrtr_socket(void);
+int qrtr_bind(int sock, const struct sockaddr_qrtr *sq);
+int qrtr_getsockname(int sock, struct sockaddr_qrtr *sq);
+ssize_t qrtr_sendto(int sock, const void *buf, size_t len, int flags, const struct sockaddr_qrtr *sq);
+ssize_t qrtr_recvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr_qrtr *sq);
+int qrtr_close(int sock);
+
 struct qrtr_node *qrtr_node_new(int node_id, int fd);
+int qrtr_node_use_uring(struct qrtr_node *node, unsigned int depth, size_t buf_size);
+struct qrtr_pkt *qrtr_node_recv(struct qrtr_node *node);
+struct qrtr_capture *qrtr_node_capture(void);
+ssize_t qrtr_node_writev(struct qrtr_node *node, const struct iovec *iov, int iovcnt);
 ssize_t qrtr_node_hello(struct qrtr_node *node);
-void qrtr_resume_tx(struct qrtr_node *node, int local_node, int local_port, int remote_node, int remote_port);
+ssize_t qrtr_node_new_server(struct qrtr_node *node, unsigned int service, unsigned int instance, int port);
+ssize_t qrtr_resume_tx(struct qrtr_node *node, int local_node, int local_port, int remote_node, int remote_port);
 ssize_t send_data(struct qrtr_node *node, int port, struct sockaddr_qrtr *dest, const void *data, size_t len, int confirm_rx);
 
+int qrtr_tx_template_init(struct qrtr_tx_template *tmpl, struct qrtr_node *node, int port, const struct sockaddr_qrtr *dest);
+int qrtr_node_send_batch(struct qrtr_node *node, struct qrtr_tx_desc *descs, int count);
+
 #endif
@@ -0,0 +1,512 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qrtr-uring.h"
+#include "util.h"
+
+/*
+ * io_uring backed packet I/O for a qrtr-tun file descriptor.
+ *
+ * One read is kept in flight, picking its destination from a ring of provided
+ * receive buffers; reads on the blocking tun fd may complete in any order, so
+ * a single read is what keeps packets in the order they arrived. It's re-armed
+ * before qrtr_uring_recv() returns, so the next packet is read while the
+ * caller handles the last one. Up to "depth" writes are queued from a set of
+ * registered transmit slots. Queued writes are linked, so that a
+ * batch reaches the tun in order, and are submitted together with the next
+ * wait for completions, on qrtr_uring_flush() or when the transmit slots run
+ * out. Write errors are reported by the following call to
+ * qrtr_uring_writev().
+ *
+ * liburing is deliberately not used, to keep the tests free of external
+ * dependencies.
+ */
+
+#define TX_TAG		(1ull << 63)
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct qrtr_uring {
+	int fd;
+	int ring_fd;
+
+	unsigned int depth;
+	size_t buf_size;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_entries;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+
+	struct io_uring_sqe *last_tx;
+
+	/* Receive buffers, handed to the kernel through a buffer ring */
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	unsigned int br_entries;
+	unsigned short br_tail;
+	char *rx_bufs;
+
+	unsigned int rx_inflight;
+	unsigned int rx_held;
+	int rx_err;
+
+	unsigned short *ready_bid;
+	unsigned int *ready_len;
+	unsigned int ready_head;
+	unsigned int ready_count;
+
+	/* Transmit slots, registered as one fixed buffer */
+	char *tx_bufs;
+	unsigned int *tx_free;
+	unsigned int tx_nfree;
+	int tx_err;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			  unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned int roundup_pow2(unsigned int v)
+{
+	unsigned int r = 1;
+
+	while (r < v)
+		r <<= 1;
+
+	return r;
+}
+
+static void close_tx_chain(struct qrtr_uring *ring)
+{
+	if (ring->last_tx) {
+		ring->last_tx->flags &= ~IOSQE_IO_LINK;
+		ring->last_tx = NULL;
+	}
+}
+
+static unsigned int sq_pending(struct qrtr_uring *ring)
+{
+	return *ring->sq_tail - load_acquire(ring->sq_head);
+}
+
+static int uring_enter(struct qrtr_uring *ring, unsigned int min_complete, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg = {};
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	int ret;
+
+	close_tx_chain(ring);
+
+	if (min_complete) {
+		flags |= IORING_ENTER_GETEVENTS;
+
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+
+	ret = io_uring_enter(ring->ring_fd, sq_pending(ring), min_complete, flags,
+			     flags & IORING_ENTER_EXT_ARG ? &arg : NULL, sizeof(arg));
+	if (ret < 0 && (errno == ETIME || errno == EINTR))
+		return 0;
+
+	return ret;
+}
+
+static struct io_uring_sqe *get_sqe(struct qrtr_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx;
+
+	if (tail - load_acquire(ring->sq_head) == ring->sq_entries) {
+		if (uring_enter(ring, 0, 0) < 0)
+			return NULL;
+	}
+
+	idx = tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring->sq_array[idx] = idx;
+	store_release(ring->sq_tail, tail + 1);
+
+	return sqe;
+}
+
+static void reap(struct qrtr_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = load_acquire(ring->cq_tail);
+	unsigned int idx;
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+
+		if (cqe->user_data & TX_TAG) {
+			ring->tx_free[ring->tx_nfree++] = cqe->user_data & ~TX_TAG;
+			if (cqe->res < 0 && !ring->tx_err)
+				ring->tx_err = -cqe->res;
+			continue;
+		}
+
+		ring->rx_inflight--;
+
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+			if (cqe->res < 0 && cqe->res != -ENOBUFS && !ring->rx_err)
+				ring->rx_err = -cqe->res;
+			continue;
+		}
+
+		idx = (ring->ready_head + ring->ready_count) % ring->br_entries;
+		ring->ready_bid[idx] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		ring->ready_len[idx] = MAX(cqe->res, 0);
+		ring->ready_count++;
+		ring->rx_held++;
+	}
+
+	store_release(ring->cq_head, head);
+}
+
+static void arm_read(struct qrtr_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	close_tx_chain(ring);
+
+	/* More than one read in flight could complete out of order */
+	if (!ring->rx_inflight && ring->rx_held < ring->br_entries) {
+		sqe = get_sqe(ring);
+		if (!sqe)
+			return;
+
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = ring->fd;
+		sqe->off = -1;
+		sqe->len = ring->buf_size;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = 0;
+
+		ring->rx_inflight = 1;
+	}
+}
+
+static void provide_buffer(struct qrtr_uring *ring, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring->br->bufs[ring->br_tail & (ring->br_entries - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ring->rx_bufs + bid * ring->buf_size);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+
+	ring->br_tail++;
+	store_release(&ring->br->tail, ring->br_tail);
+}
+
+struct qrtr_uring *qrtr_uring_new(int fd, unsigned int depth, size_t buf_size)
+{
+	struct io_uring_buf_reg reg = {};
+	struct io_uring_params p = {};
+	struct qrtr_uring *ring;
+	struct iovec iov;
+	unsigned int i;
+	int saved_errno;
+	int ret;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->fd = fd;
+	ring->depth = depth = roundup_pow2(depth);
+	ring->buf_size = buf_size;
+	ring->ring_fd = -1;
+
+	/* Room for the read and a full set of writes */
+	ring->ring_fd = io_uring_setup(depth + 1, &p);
+	if (ring->ring_fd < 0)
+		goto err;
+
+	ring->sq_entries = p.sq_entries;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_len = ring->cq_len = MAX(ring->sq_len, ring->cq_len);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto err;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = *(unsigned int *)(ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = *(unsigned int *)(ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	/* Receive buffers for the caller to hold up to twice the depth in packets */
+	ring->br_entries = 2 * depth;
+	ring->br_len = ring->br_entries * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED)
+		goto err;
+
+	ring->rx_bufs = malloc(ring->br_entries * buf_size);
+	ring->ready_bid = calloc(ring->br_entries, sizeof(*ring->ready_bid));
+	ring->ready_len = calloc(ring->br_entries, sizeof(*ring->ready_len));
+	ring->tx_bufs = malloc(depth * buf_size);
+	ring->tx_free = calloc(depth, sizeof(*ring->tx_free));
+	if (!ring->rx_bufs || !ring->ready_bid || !ring->ready_len ||
+	    !ring->tx_bufs || !ring->tx_free) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+	reg.ring_entries = ring->br_entries;
+	reg.bgid = 0;
+	ret = io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (ret < 0)
+		goto err;
+
+	for (i = 0; i < ring->br_entries; i++)
+		provide_buffer(ring, i);
+
+	iov.iov_base = ring->tx_bufs;
+	iov.iov_len = depth * buf_size;
+	ret = io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	if (ret < 0)
+		goto err;
+
+	for (i = 0; i < depth; i++)
+		ring->tx_free[ring->tx_nfree++] = i;
+
+	return ring;
+
+err:
+	saved_errno = errno;
+	qrtr_uring_free(ring);
+	errno = saved_errno;
+
+	return NULL;
+}
+
+void qrtr_uring_free(struct qrtr_uring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->ring_fd >= 0)
+		close(ring->ring_fd);
+	if (ring->br && ring->br != MAP_FAILED)
+		munmap(ring->br, ring->br_len);
+
+	free(ring->rx_bufs);
+	free(ring->ready_bid);
+	free(ring->ready_len);
+	free(ring->tx_bufs);
+	free(ring->tx_free);
+	free(ring);
+}
+
+ssize_t qrtr_uring_writev(struct qrtr_uring *ring, const struct iovec *iov, int iovcnt)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int slot;
+	size_t len = 0;
+	char *buf;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > ring->buf_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	while (!ring->tx_nfree) {
+		if (uring_enter(ring, 1, -1) < 0)
+			return -1;
+		reap(ring);
+	}
+
+	if (ring->tx_err) {
+		errno = ring->tx_err;
+		ring->tx_err = 0;
+		return -1;
+	}
+
+	slot = ring->tx_free[--ring->tx_nfree];
+	buf = ring->tx_bufs + slot * ring->buf_size;
+
+	for (i = 0, len = 0; i < iovcnt; i++) {
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	sqe = get_sqe(ring);
+	if (!sqe) {
+		ring->tx_free[ring->tx_nfree++] = slot;
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = ring->fd;
+	sqe->off = -1;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->buf_index = 0;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = TX_TAG | slot;
+
+	ring->last_tx = sqe;
+
+	return len;
+}
+
+int qrtr_uring_flush(struct qrtr_uring *ring)
+{
+	if (!sq_pending(ring))
+		return 0;
+
+	return uring_enter(ring, 0, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Wait up to timeout_ms (-1 for ever) for received packets and return up to
+ * count of them; each returned packet must be handed back with
+ * qrtr_uring_release(). Pending writes are submitted in the same system call.
+ */
+int qrtr_uring_recv(struct qrtr_uring *ring, struct qrtr_uring_pkt *pkts, int count, int timeout_ms)
+{
+	uint64_t deadline = time_ns() + timeout_ms * 1000000ull;
+	unsigned int idx;
+	uint64_t now;
+	int wait_ms;
+	int n = 0;
+
+	for (;;) {
+		reap(ring);
+		if (ring->ready_count || ring->rx_err)
+			break;
+
+		arm_read(ring);
+
+		/* Write completions wake us up too, so track the deadline */
+		wait_ms = timeout_ms;
+		if (timeout_ms > 0) {
+			now = time_ns();
+			wait_ms = now < deadline ? (deadline - now + 999999) / 1000000 : 0;
+		}
+
+		if (uring_enter(ring, wait_ms ? 1 : 0, wait_ms) < 0)
+			return -1;
+
+		if (!wait_ms) {
+			reap(ring);
+			break;
+		}
+	}
+
+	/* Read the next packet while the caller handles these */
+	arm_read(ring);
+
+	if (qrtr_uring_flush(ring) < 0)
+		return -1;
+
+	if (!ring->ready_count && ring->rx_err) {
+		errno = ring->rx_err;
+		ring->rx_err = 0;
+		return -1;
+	}
+
+	while (n < count && ring->ready_count) {
+		idx = ring->ready_head;
+
+		pkts[n].bid = ring->ready_bid[idx];
+		pkts[n].len = ring->ready_len[idx];
+		pkts[n].data = ring->rx_bufs + pkts[n].bid * ring->buf_size;
+		n++;
+
+		ring->ready_head = (idx + 1) % ring->br_entries;
+		ring->ready_count--;
+	}
+
+	return n;
+}
+
+void qrtr_uring_release(struct qrtr_uring *ring, struct qrtr_uring_pkt *pkt)
+{
+	provide_buffer(ring, pkt->bid);
+	ring->rx_held--;
+}
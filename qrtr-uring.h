@@ -0,0 +1,25 @@
+#ifndef __QRTR_URING_H__
+#define __QRTR_URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct qrtr_uring;
+
+struct qrtr_uring_pkt {
+	void *data;
+	size_t len;
+
+	unsigned int bid;
+};
+
+struct qrtr_uring *qrtr_uring_new(int fd, unsigned int depth, size_t buf_size);
+void qrtr_uring_free(struct qrtr_uring *ring);
+
+ssize_t qrtr_uring_writev(struct qrtr_uring *ring, const struct iovec *iov, int iovcnt);
+int qrtr_uring_flush(struct qrtr_uring *ring);
+
+int qrtr_uring_recv(struct qrtr_uring *ring, struct qrtr_uring_pkt *pkts, int count, int timeout_ms);
+void qrtr_uring_release(struct qrtr_uring *ring, struct qrtr_uring_pkt *pkt);
+
+#endif
@@ -28,51 +28,495 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-#include <ctype.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "util.h"
 
-static uint8_t to_hex(uint8_t ch)
+/*
+ * Asynchronous logging.
+ *
+ * Log records are formatted by the calling thread into a per thread ring and
+ * written out by a background thread, which every LOG_FLUSH_MS gathers what
+ * is queued in all rings into a single writev(), so logging costs the caller
+ * a copy rather than a system call. Each ring has a single producer and the
+ * writer as its only consumer, so no locks are taken on the logging path.
+ *
+ * Output goes to stderr, or to the file named by QRTR_LOG. Each thread may
+ * log QRTR_LOG_RATE bytes per second, with a burst of as much, and records
+ * that exceed the rate, are larger than LOG_RECORD_MAX or don't fit the ring
+ * are dropped; the writer reports
+ * the number of dropped records. Whatever is queued is written at exit, and
+ * when a thread exits its ring is written out and freed.
+ */
+
+#define LOG_RING_SIZE		(256 * 1024)
+#define LOG_FLUSH_MS		10
+#define LOG_RATE		(4 * 1024 * 1024)
+
+/* Largest record a ring takes, larger ones are dropped */
+#define LOG_RECORD_MAX		(LOG_RING_SIZE / 4)
+
+/* Rings gathered into each writev() */
+#define LOG_DRAIN_BATCH		64
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+struct log_ring {
+	struct log_ring *next;
+
+	/* Free running, head is advanced by the owner and tail by the writer */
+	size_t head;
+	size_t tail;
+
+	uint64_t dropped;
+	uint64_t reported;
+
+	uint64_t tokens;
+	uint64_t refill;
+
+	char buf[LOG_RING_SIZE];
+};
+
+static __thread struct log_ring *log_local;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static struct log_ring *log_rings;
+
+static pthread_t log_thread;
+static bool log_thread_running;
+static bool log_stop;
+
+static uint64_t log_rate = LOG_RATE;
+static int log_fd = STDERR_FILENO;
+
+/*
+ * Write out what's queued in up to LOG_DRAIN_BATCH rings, starting at @first,
+ * with a single writev() when possible. Returns the ring to continue with.
+ */
+static struct log_ring *log_drain_batch(struct log_ring *first)
 {
-	ch &= 0xf;
-	return ch <= 9 ? '0' + ch : 'a' + ch - 10;
+	struct iovec iov[2 * LOG_DRAIN_BATCH + 1];
+	struct log_ring *rings[LOG_DRAIN_BATCH];
+	struct log_ring *ring;
+	size_t heads[LOG_DRAIN_BATCH];
+	char note[128];
+	size_t note_len = 0;
+	uint64_t dropped;
+	unsigned int count = 0;
+	unsigned int niov = 0;
+	unsigned int seen = 0;
+	unsigned int i;
+	size_t head;
+	size_t off;
+	size_t len;
+	ssize_t n;
+
+	for (ring = first; ring && seen < LOG_DRAIN_BATCH; ring = ring->next, seen++) {
+		head = load_acquire(&ring->head);
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+		if (dropped != ring->reported && note_len < sizeof(note) / 2) {
+			note_len += snprintf(note + note_len, sizeof(note) - note_len,
+					     "log: %llu records dropped\n",
+					     (unsigned long long)(dropped - ring->reported));
+			ring->reported = dropped;
+		}
+
+		if (head == ring->tail)
+			continue;
+
+		/* The queued data may wrap around the end of the ring */
+		off = ring->tail % LOG_RING_SIZE;
+		len = MIN(head - ring->tail, LOG_RING_SIZE - off);
+		iov[niov].iov_base = ring->buf + off;
+		iov[niov++].iov_len = len;
+
+		if (len < head - ring->tail) {
+			iov[niov].iov_base = ring->buf;
+			iov[niov++].iov_len = head - ring->tail - len;
+		}
+
+		rings[count] = ring;
+		heads[count++] = head;
+	}
+
+	if (note_len) {
+		iov[niov].iov_base = note;
+		iov[niov++].iov_len = note_len;
+	}
+
+	for (i = 0; i < niov; ) {
+		n = writev(log_fd, iov + i, niov - i);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+
+		for (; i < niov && n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+
+		if (i < niov) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		store_release(&rings[i]->tail, heads[i]);
+
+	return ring;
 }
 
-void print_hex_dump(const char *prefix, const void *buf, size_t len)
+/*
+ * Write out everything queued in all rings. The lock is held throughout, so
+ * that no ring is freed while it's being written from.
+ */
+static void log_drain(void)
 {
-	const uint8_t *ptr = buf;
-	size_t linelen;
-	uint8_t ch;
-	char line[16 * 3 + 16 + 1];
-	int li;
-	int i;
-	int j;
+	struct log_ring *ring;
 
-	for (i = 0; i < len; i += 16) {
-		linelen = MIN(16, len - i);
-		li = 0;
-
-		for (j = 0; j < linelen; j++) {
-			ch = ptr[i + j];
-			line[li++] = to_hex(ch >> 4);
-			line[li++] = to_hex(ch);
-			line[li++] = ' ';
-		}
+	pthread_mutex_lock(&log_lock);
+
+	for (ring = log_rings; ring; )
+		ring = log_drain_batch(ring);
+
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void *log_writer(void *data)
+{
+	struct timespec ts = { 0, LOG_FLUSH_MS * 1000000 };
+
+	while (!load_acquire(&log_stop)) {
+		log_drain();
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+static void log_exit(void)
+{
+	if (load_acquire(&log_thread_running)) {
+		store_release(&log_stop, true);
+		pthread_join(log_thread, NULL);
+		store_release(&log_thread_running, false);
+	}
+
+	log_drain();
+}
+
+/* Thread exit: write out what the thread queued, then drop its ring */
+static void log_ring_release(void *data)
+{
+	struct log_ring *ring = data;
+	struct log_ring **pp;
+
+	/* Anything logged from here on gets a fresh ring */
+	log_local = NULL;
 
-		for (; j < 16; j++) {
-			line[li++] = ' ';
-			line[li++] = ' ';
-			line[li++] = ' ';
+	log_drain();
+
+	pthread_mutex_lock(&log_lock);
+	for (pp = &log_rings; *pp; pp = &(*pp)->next) {
+		if (*pp == ring) {
+			*pp = ring->next;
+			break;
 		}
+	}
+	pthread_mutex_unlock(&log_lock);
+
+	free(ring);
+}
+
+/*
+ * The writer isn't inherited and the parent writes out what it queued; of
+ * the rings only the forking thread's remains in use.
+ */
+static void log_atfork_child(void)
+{
+	struct log_ring *ring;
+	struct log_ring *next;
+
+	pthread_mutex_init(&log_lock, NULL);
+
+	for (ring = log_rings; ring; ring = next) {
+		next = ring->next;
+
+		if (ring != log_local)
+			free(ring);
+	}
+
+	log_rings = log_local;
+	if (log_local) {
+		log_local->next = NULL;
+		log_local->tail = log_local->head;
+		log_local->reported = log_local->dropped;
+	}
+
+	log_thread_running = false;
+}
+
+static void log_init(void)
+{
+	const char *path;
+	const char *rate;
+	int fd;
+
+	path = getenv(QRTR_LOG_ENV);
+	if (path) {
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0)
+			warn("failed to open log file %s", path);
+		else
+			log_fd = fd;
+	}
+
+	rate = getenv(QRTR_LOG_RATE_ENV);
+	if (rate)
+		log_rate = strtoull(rate, NULL, 0);
 
-		for (j = 0; j < linelen; j++) {
-			ch = ptr[i + j];
-			line[li++] = isprint(ch) ? ch : '.';
+	pthread_key_create(&log_key, log_ring_release);
+	pthread_atfork(NULL, NULL, log_atfork_child);
+	atexit(log_exit);
+}
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring = log_local;
+	int ret;
+
+	if (!ring) {
+		pthread_once(&log_once, log_init);
+
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+
+		ring->tokens = log_rate;
+		ring->refill = time_ns();
+
+		pthread_mutex_lock(&log_lock);
+		ring->next = log_rings;
+		log_rings = ring;
+		pthread_mutex_unlock(&log_lock);
+
+		log_local = ring;
+		pthread_setspecific(log_key, ring);
+	}
+
+	/* Started on first use in each process, forked children included */
+	if (!load_acquire(&log_thread_running)) {
+		pthread_mutex_lock(&log_lock);
+		if (!log_thread_running) {
+			store_release(&log_stop, false);
+			ret = pthread_create(&log_thread, NULL, log_writer, NULL);
+			if (!ret)
+				store_release(&log_thread_running, true);
 		}
+		pthread_mutex_unlock(&log_lock);
+	}
+
+	return ring;
+}
+
+/*
+ * Make room for a len byte record in the calling thread's ring, counting it
+ * as dropped if it's too large, exceeds the rate or doesn't fit. The record
+ * is then copied in with log_copy() and queued by log_commit().
+ */
+static bool log_reserve(struct log_ring *ring, size_t len)
+{
+	size_t tail = load_acquire(&ring->tail);
+	uint64_t now;
+
+	if (len > LOG_RECORD_MAX)
+		goto drop;
+
+	if (log_rate && ring->tokens < len) {
+		now = time_ns();
+		ring->tokens = MIN(log_rate, ring->tokens +
+				   (now - ring->refill) * log_rate / 1000000000);
+		ring->refill = now;
+	}
+
+	if ((log_rate && ring->tokens < len) || ring->head + len - tail > LOG_RING_SIZE)
+		goto drop;
+
+	if (log_rate)
+		ring->tokens -= len;
+
+	return true;
+
+drop:
+	__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/* Copy into the ring at offset pos from the head, wrapping as needed */
+static void log_copy(struct log_ring *ring, size_t pos, const void *data, size_t len)
+{
+	size_t off = (ring->head + pos) % LOG_RING_SIZE;
+	size_t n = MIN(len, LOG_RING_SIZE - off);
+
+	memcpy(ring->buf + off, data, n);
+	memcpy(ring->buf, (const char *)data + n, len - n);
+}
+
+static void log_commit(struct log_ring *ring, size_t len)
+{
+	store_release(&ring->head, ring->head + len);
+}
+
+/* Nibbles to lower case hex digits, 16 at a time */
+static v16u8 hex_digits(v16u8 nibbles)
+{
+	v16u8 alpha = nibbles > 9;
+
+	return nibbles + '0' + (alpha & ('a' - '0' - 10));
+}
+
+/* Replace the non-printable bytes with '.', as isprint() in the C locale */
+static v16u8 printable(v16u8 bytes)
+{
+	v16u8 mask = (bytes >= 0x20) & (bytes < 0x7f);
+
+	return (bytes & mask) | ('.' & ~mask);
+}
+
+/* Hex digits in the offset column, at least 4 as with "%04x" */
+static int hex_dump_digits(size_t offset)
+{
+	int digits = 4;
 
-		line[li] = '\0';
+	while (digits < 2 * sizeof(offset) && offset >> (4 * digits))
+		digits++;
 
-		printf("%s %04x: %s\n", prefix, i, line);
+	return digits;
+}
+
+/*
+ * Format one line of the hex dump, the hex and ASCII columns are computed for
+ * all 16 bytes at once.
+ */
+static size_t hex_dump_line(char *out, const char *prefix, size_t prefix_len,
+			    size_t offset, const uint8_t *data, size_t len)
+{
+	v16u8 bytes = {};
+	v16u8 hi;
+	v16u8 lo;
+	v16u8 ascii;
+	char *p = out;
+	int i;
+
+	memcpy(&bytes, data, len);
+
+	hi = hex_digits(bytes >> 4);
+	lo = hex_digits(bytes & 0xf);
+	ascii = printable(bytes);
+
+	memcpy(p, prefix, prefix_len);
+	p += prefix_len;
+
+	*p++ = ' ';
+	for (i = 4 * hex_dump_digits(offset) - 4; i >= 0; i -= 4)
+		*p++ = "0123456789abcdef"[(offset >> i) & 0xf];
+	*p++ = ':';
+	*p++ = ' ';
+
+	for (i = 0; i < 16; i++) {
+		p[0] = i < len ? hi[i] : ' ';
+		p[1] = i < len ? lo[i] : ' ';
+		p[2] = ' ';
+		p += 3;
+	}
+
+	memcpy(p, &ascii, len);
+	p += len;
+	*p++ = '\n';
+
+	return p - out;
+}
+
+/*
+ * Log a hex dump of buf, 16 bytes per line, through the asynchronous log. The
+ * whole dump is one record, so it's either logged in full or dropped.
+ */
+void print_hex_dump(const char *prefix, const void *buf, size_t len)
+{
+	struct log_ring *ring = log_ring_get();
+	const uint8_t *ptr = buf;
+	size_t prefix_len = MIN(strlen(prefix), 64);
+	char line[64 + 3 + 2 * sizeof(size_t) + 16 * 3 + 16 + 1];
+	size_t total;
+	size_t off = 0;
+	size_t n;
+	size_t i;
+
+	if (!ring || !len)
+		return;
+
+	/*
+	 * Prefix, offset, hex column and newline for each line, plus the ASCII;
+	 * no offset is wider than the last one.
+	 */
+	total = (len + 15) / 16 * (prefix_len + 3 + hex_dump_digits(len - 1) +
+				   16 * 3 + 1) + len;
+
+	if (!log_reserve(ring, total))
+		return;
+
+	for (i = 0; i < len; i += 16) {
+		n = hex_dump_line(line, prefix, prefix_len, i, ptr + i, MIN(16, len - i));
+		log_copy(ring, off, line, n);
+		off += n;
 	}
+
+	log_commit(ring, off);
+}
+
+uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* User plus system time consumed by the calling process */
+uint64_t cpu_time_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+/* CPU time consumed by the calling thread */
+uint64_t thread_cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
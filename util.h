@@ -31,13 +31,23 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+#define QRTR_LOG_ENV		"QRTR_LOG"
+#define QRTR_LOG_RATE_ENV	"QRTR_LOG_RATE"
+
 void print_hex_dump(const char *prefix, const void *buf, size_t len);
 
+uint64_t time_ns(void);
+uint64_t cpu_time_ns(void);
+uint64_t thread_cpu_time_ns(void);
+
 #define container_of(ptr, type, member) ({ \
 		const typeof(((type *)0)->member)*__mptr = (ptr);  \
 		(type *)((char *)__mptr - offsetof(type, member)); \